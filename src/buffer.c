@@ -0,0 +1,398 @@
+#include "core.h"
+#include "buffer.h"
+#include "util.h"
+
+static int
+buffer_class(size_t size) {
+    int c;
+
+    ASSERT(size >= BUFFER_MIN_SIZE && size <= BUFFER_MAX_SIZE);
+    ASSERT((size & (size - 1)) == 0);
+
+    c = 0;
+    while (((size_t)BUFFER_MIN_SIZE << c) < size) {
+        c++;
+    }
+
+    return c;
+}
+
+void
+buffer_pool_init(struct buffer_pool *bp, size_t limit, size_t cap) {
+    int i;
+
+    for (i = 0; i < BUFFER_NCLASS; i++) {
+        bp->free[i] = NULL;
+        bp->nfree[i] = 0;
+        bp->nused[i] = 0;
+    }
+
+    bp->cached = 0;
+    bp->used = 0;
+    bp->peak = 0;
+    bp->cap = cap;
+    bp->nget = 0;
+    bp->nmiss = 0;
+    bp->nfail = 0;
+
+    /* Never cache more than the cap */
+    bp->limit = cap > 0 ? MIN(limit, cap) : limit;
+}
+
+void
+buffer_pool_deinit(struct buffer_pool *bp) {
+    struct buffer_free *b;
+    int i;
+
+    for (i = 0; i < BUFFER_NCLASS; i++) {
+        while (bp->free[i] != NULL) {
+            b = bp->free[i];
+            bp->free[i] = b->next;
+            rps_free(b);
+        }
+        bp->nfree[i] = 0;
+    }
+
+    bp->cached = 0;
+}
+
+/* Size must be a class size, see buffer_size */
+void *
+buffer_get(struct buffer_pool *bp, size_t size) {
+    struct buffer_free *b;
+    int c;
+
+    c = buffer_class(size);
+
+    bp->nget++;
+
+    if (bp->cap > 0 && bp->used + size > bp->cap) {
+        bp->nfail++;
+        return NULL;
+    }
+
+    b = bp->free[c];
+    if (b != NULL) {
+        bp->free[c] = b->next;
+        bp->nfree[c]--;
+        bp->cached -= size;
+    } else {
+        bp->nmiss++;
+        b = rps_alloc(size);
+        if (b == NULL) {
+            bp->nfail++;
+            return NULL;
+        }
+    }
+
+    bp->nused[c]++;
+    bp->used += size;
+    bp->peak = MAX(bp->peak, bp->used);
+
+    return b;
+}
+
+void
+buffer_put(struct buffer_pool *bp, void *buf, size_t size) {
+    struct buffer_free *b;
+    int c;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    c = buffer_class(size);
+
+    ASSERT(bp->nused[c] > 0);
+    bp->nused[c]--;
+    bp->used -= size;
+
+    if (bp->cached + size > bp->limit) {
+        rps_free(buf);
+        return;
+    }
+
+    b = buf;
+    b->next = bp->free[c];
+    bp->free[c] = b;
+    bp->nfree[c]++;
+    bp->cached += size;
+}
+
+/* Log usage of the pool, peak be reset for next period */
+void
+buffer_pool_stats(struct buffer_pool *bp, const char *name) {
+    char classes[BUFFER_NCLASS * 24];
+    size_t n;
+    int i;
+
+    n = 0;
+    for (i = 0; i < BUFFER_NCLASS; i++) {
+        n += snprintf(&classes[n], sizeof(classes) - n, "%s%dk:%u/%u", i > 0 ? " " : "",
+                (BUFFER_MIN_SIZE << i) >> 10, bp->nused[i], bp->nfree[i]);
+    }
+
+    log_info("%s buffers used %zu bytes, peak %zu, cached %zu, cap %zu, "
+            "get %llu, miss %llu, fail %llu, used/free [%s]", 
+            name, bp->used, bp->peak, bp->cached, bp->cap, 
+            (unsigned long long)bp->nget, (unsigned long long)bp->nmiss, 
+            (unsigned long long)bp->nfail, classes);
+
+    bp->peak = bp->used;
+}
+
+/* Size must be a class size, data capacity be size minus the header */
+struct chunk *
+chunk_get(struct buffer_pool *bp, size_t size) {
+    struct chunk *c;
+
+    c = buffer_get(bp, size);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->next = NULL;
+    c->pool = bp;
+    c->refcount = 1;
+    c->size = (uint32_t)size;
+    c->start = 0;
+    c->end = 0;
+
+    return c;
+}
+
+void
+chunk_unref(struct chunk *c) {
+    if (c == NULL) {
+        return;
+    }
+
+    ASSERT(c->refcount > 0);
+
+    if (--c->refcount > 0) {
+        return;
+    }
+
+    buffer_put(c->pool, c, c->size);
+}
+
+void
+chunk_queue_init(struct chunk_queue *q) {
+    q->head = NULL;
+    q->tail = NULL;
+    q->bytes = 0;
+    q->nchunks = 0;
+}
+
+void
+chunk_queue_deinit(struct chunk_queue *q) {
+    struct chunk *c;
+
+    while (q->head != NULL) {
+        c = q->head;
+        q->head = c->next;
+        chunk_unref(c);
+    }
+
+    chunk_queue_init(q);
+}
+
+/* Queue takes its own reference of the chunk */
+void
+chunk_queue_push(struct chunk_queue *q, struct chunk *c) {
+    ASSERT(c->next == NULL);
+
+    chunk_ref(c);
+
+    if (q->tail == NULL) {
+        q->head = c;
+    } else {
+        q->tail->next = c;
+    }
+    q->tail = c;
+
+    q->bytes += chunk_len(c);
+    q->nchunks++;
+}
+
+/* 
+ * Copy data to the queue, fill the room of tail chunk first if only the queue
+ * hold it, data appended beyond the in-flight range is safe to write.
+ */
+int
+chunk_queue_append(struct chunk_queue *q, struct buffer_pool *bp, 
+        const char *data, size_t len) {
+    struct chunk *c;
+    size_t n;
+
+    c = q->tail;
+
+    while (len > 0) {
+        if (c == NULL || c->refcount > 1 || c->end == chunk_capacity(c)) {
+            c = chunk_get(bp, buffer_size(len + sizeof(struct chunk)));
+            if (c == NULL) {
+                return RPS_ENOMEM;
+            }
+            chunk_queue_push(q, c);
+            chunk_unref(c);
+        }
+
+        n = MIN(len, chunk_capacity(c) - c->end);
+        memcpy(&c->data[c->end], data, n);
+        c->end += n;
+        q->bytes += n;
+
+        data += n;
+        len -= n;
+    }
+
+    return RPS_OK;
+}
+
+/* Fill at most n buffers with pending data from head, return the count */
+unsigned int
+chunk_queue_peek(struct chunk_queue *q, uv_buf_t *bufs, 
+        struct chunk **chunks, unsigned int n, size_t *len) {
+    struct chunk *c;
+    unsigned int i;
+
+    *len = 0;
+
+    for (i = 0, c = q->head; i < n && c != NULL; c = c->next) {
+        if (chunk_len(c) == 0) {
+            continue;
+        }
+        bufs[i] = uv_buf_init(&c->data[c->start], chunk_len(c));
+        if (chunks != NULL) {
+            chunks[i] = c;
+        }
+        *len += chunk_len(c);
+        i++;
+    }
+
+    return i;
+}
+
+/* Drop len bytes sent out from head, release the drained chunks */
+void
+chunk_queue_consume(struct chunk_queue *q, size_t len) {
+    struct chunk *c;
+    size_t n;
+
+    ASSERT(len <= q->bytes);
+
+    q->bytes -= len;
+
+    while ((c = q->head) != NULL) {
+        n = MIN(len, chunk_len(c));
+        c->start += n;
+        len -= n;
+
+        if (chunk_len(c) > 0) {
+            break;
+        }
+
+        q->head = c->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        q->nchunks--;
+        c->next = NULL;
+        chunk_unref(c);
+    }
+
+    ASSERT(len == 0);
+}
+
+void
+object_pool_init(struct object_pool *op, size_t size, uint32_t max) {
+    ASSERT(size >= sizeof(struct buffer_free));
+
+    op->free = NULL;
+    op->size = size;
+    op->nfree = 0;
+    op->max = max;
+    op->low = 0;
+    op->nget = 0;
+    op->nhit = 0;
+}
+
+void
+object_pool_deinit(struct object_pool *op) {
+    struct buffer_free *o;
+
+    while (op->free != NULL) {
+        o = op->free;
+        op->free = o->next;
+        rps_free(o);
+    }
+
+    op->nfree = 0;
+    op->low = 0;
+}
+
+void *
+object_get(struct object_pool *op) {
+    struct buffer_free *o;
+
+    op->nget++;
+
+    o = op->free;
+    if (o == NULL) {
+        return rps_alloc(op->size);
+    }
+
+    op->free = o->next;
+    op->nfree--;
+    op->nhit++;
+    op->low = MIN(op->low, op->nfree);
+
+    return o;
+}
+
+void
+object_put(struct object_pool *op, void *obj) {
+    struct buffer_free *o;
+
+    if (obj == NULL) {
+        return;
+    }
+
+    if (op->nfree >= op->max) {
+        rps_free(obj);
+        return;
+    }
+
+    o = obj;
+    o->next = op->free;
+    op->free = o;
+    op->nfree++;
+}
+
+/* 
+ * Release the objects which stayed unused during the whole period 
+ * since last trim, return the number released.
+ */
+uint32_t
+object_pool_trim(struct object_pool *op) {
+    struct buffer_free *o;
+    uint32_t n;
+
+    for (n = 0; n < op->low && op->free != NULL; n++) {
+        o = op->free;
+        op->free = o->next;
+        op->nfree--;
+        rps_free(o);
+    }
+
+    op->low = op->nfree;
+
+    return n;
+}
+
+void
+object_pool_stats(struct object_pool *op, const char *name) {
+    log_info("%s free %u, hit %llu/%llu (%.1f%%)", name, op->nfree, 
+            (unsigned long long)op->nhit, (unsigned long long)op->nget,
+            op->nget > 0 ? 100.0 * op->nhit / op->nget : 0.0);
+}
@@ -0,0 +1,135 @@
+/*
+ * Loop local buffer pool, buffers are power of two size classes from
+ * BUFFER_MIN_SIZE to BUFFER_MAX_SIZE. Free buffers are linked through 
+ * their own memory, so the pool costs nothing besides the cached buffers.
+ * Object pool recycle fixed size structs the same way.
+ * Not thread safe, every server loop owns its pools.
+ */
+
+#ifndef _RPS_BUFFER_H
+#define _RPS_BUFFER_H
+
+#include <uv.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUFFER_MIN_SHIFT    11  /* 2k */
+#define BUFFER_MAX_SHIFT    16  /* 64k */
+#define BUFFER_MIN_SIZE     (1 << BUFFER_MIN_SHIFT)
+#define BUFFER_MAX_SIZE     (1 << BUFFER_MAX_SHIFT)
+#define BUFFER_NCLASS       (BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+
+#define BUFFER_POOL_DEFAULT_LIMIT   (4 * 1024 * 1024) /* cached bytes */
+
+struct buffer_free {
+    struct buffer_free  *next;
+};
+
+struct buffer_pool {
+    struct buffer_free  *free[BUFFER_NCLASS];
+    uint32_t            nfree[BUFFER_NCLASS];
+    uint32_t            nused[BUFFER_NCLASS];
+    size_t              cached;  /* bytes of free buffers */
+    size_t              limit;   /* free buffers beyond limit be released */
+    size_t              used;    /* bytes of buffers in use */
+    size_t              peak;    /* max used since last stats */
+    size_t              cap;     /* refuse to hand out beyond cap, 0 unlimited */
+    uint64_t            nget;
+    uint64_t            nmiss;   /* gets served by malloc */
+    uint64_t            nfail;   /* gets refused by cap */
+};
+
+void buffer_pool_init(struct buffer_pool *bp, size_t limit, size_t cap);
+void buffer_pool_deinit(struct buffer_pool *bp);
+void *buffer_get(struct buffer_pool *bp, size_t size);
+void buffer_put(struct buffer_pool *bp, void *buf, size_t size);
+void buffer_pool_stats(struct buffer_pool *bp, const char *name);
+
+/*
+ * Refcounted chunk of a pool buffer, header and data share the buffer.
+ * A chunk sits in at most one queue, the holders besides the queue 
+ * (e.g. the context read into it) take their own reference.
+ */
+struct chunk {
+    struct chunk        *next;
+    struct buffer_pool  *pool;
+    uint32_t            refcount;
+    uint32_t            size;   /* pool buffer size, header included */
+    uint32_t            start;  /* pending data be data[start, end) */
+    uint32_t            end;
+    char                data[];
+};
+
+/* Output queue of chunks, bytes count pending data including in flight */
+struct chunk_queue {
+    struct chunk        *head;
+    struct chunk        *tail;
+    size_t              bytes;
+    uint32_t            nchunks;
+};
+
+struct chunk *chunk_get(struct buffer_pool *bp, size_t size);
+void chunk_unref(struct chunk *c);
+
+void chunk_queue_init(struct chunk_queue *q);
+void chunk_queue_deinit(struct chunk_queue *q);
+void chunk_queue_push(struct chunk_queue *q, struct chunk *c);
+int chunk_queue_append(struct chunk_queue *q, struct buffer_pool *bp, 
+        const char *data, size_t len);
+unsigned int chunk_queue_peek(struct chunk_queue *q, uv_buf_t *bufs, 
+        struct chunk **chunks, unsigned int n, size_t *len);
+void chunk_queue_consume(struct chunk_queue *q, size_t len);
+
+static inline struct chunk *
+chunk_ref(struct chunk *c) {
+    c->refcount++;
+    return c;
+}
+
+static inline size_t
+chunk_capacity(struct chunk *c) {
+    return c->size - sizeof(struct chunk);
+}
+
+static inline size_t
+chunk_len(struct chunk *c) {
+    return c->end - c->start;
+}
+
+static inline int
+chunk_queue_empty(struct chunk_queue *q) {
+    return q->head == NULL;
+}
+
+struct object_pool {
+    struct buffer_free  *free;
+    size_t              size;   /* object size */
+    uint32_t            nfree;
+    uint32_t            max;    /* free objects beyond max be released */
+    uint32_t            low;    /* min nfree since last trim */
+    uint64_t            nget;
+    uint64_t            nhit;   /* gets served by free list */
+};
+
+void object_pool_init(struct object_pool *op, size_t size, uint32_t max);
+void object_pool_deinit(struct object_pool *op);
+void *object_get(struct object_pool *op);
+void object_put(struct object_pool *op, void *obj);
+uint32_t object_pool_trim(struct object_pool *op);
+void object_pool_stats(struct object_pool *op, const char *name);
+
+/* Round size up to its class size */
+static inline size_t
+buffer_size(size_t size) {
+    size_t n;
+
+    n = BUFFER_MIN_SIZE;
+    while (n < size && n < BUFFER_MAX_SIZE) {
+        n <<= 1;
+    }
+
+    return n;
+}
+
+#endif
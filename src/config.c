@@ -8,6 +8,7 @@
 #include <yaml.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
@@ -87,6 +88,10 @@ config_server_init(struct config_server *server) {
     server->port = 0;
     string_init(&server->username);
     string_init(&server->password);
+    server->workers = SERVER_DEFAULT_WORKERS;
+    string_init(&server->dispatch);
+    server->splice = SERVER_DEFAULT_SPLICE;
+    server->io_uring = SERVER_DEFAULT_IO_URING;
 }
 
 static void
@@ -95,6 +100,7 @@ config_server_deinit(struct config_server *server) {
     string_deinit(&server->listen);
     string_deinit(&server->username);
     string_deinit(&server->password);
+    string_deinit(&server->dispatch);
 }
 
 
@@ -107,6 +113,8 @@ config_servers_init(struct config_servers *servers) {
 
     servers->rtimeout = 0;
     servers->ftimeout = 0;
+    servers->stats = SERVER_DEFAULT_STATS;
+    servers->buffer_cap = SERVER_DEFAULT_BUFFER_CAP;
 
     return RPS_OK;
 }
@@ -136,11 +144,22 @@ config_upstreams_init(struct config_upstreams *upstreams) {
     upstreams->maxreconn = UPSTREAM_DEFAULT_MAXRECONN;
     upstreams->maxretry = UPSTREAM_DEFAULT_MAXRETRY;
     string_init(&upstreams->schedule);
+    string_init(&upstreams->hash_key);
+    string_init(&upstreams->check_target);
     upstreams->hybrid = UPSTREAM_DEFAULT_BYBRID;
     upstreams->mr1m = UPSTREAM_DEFAULT_MR1M;
     upstreams->mr1h = UPSTREAM_DEFAULT_MR1H;
     upstreams->mr1d = UPSTREAM_DEFAULT_MR1D;
     upstreams->max_fail_rate = UPSTREAM_DEFAULT_MAX_FIAL_RATE;
+    upstreams->health_halflife = UPSTREAM_DEFAULT_HEALTH_HALFLIFE * 1000;
+    upstreams->warm = UPSTREAM_DEFAULT_WARM;
+    upstreams->warm_idle = UPSTREAM_DEFAULT_WARM_IDLE * 1000;
+    upstreams->hedge = UPSTREAM_DEFAULT_HEDGE;
+    upstreams->hedge_delay = UPSTREAM_DEFAULT_HEDGE_DELAY;
+    upstreams->breaker = UPSTREAM_DEFAULT_BREAKER;
+    upstreams->breaker_backoff = UPSTREAM_DEFAULT_BREAKER_BACKOFF * 1000;
+    upstreams->check_interval = UPSTREAM_DEFAULT_CHECK_INTERVAL * 1000;
+    upstreams->check_concurrency = UPSTREAM_DEFAULT_CHECK_CONCURRENCY;
 
 #ifdef SOCKS4_PROXY_SUPPORT
     upstreams->pools = array_create(2, sizeof(struct config_upstream));
@@ -150,6 +169,8 @@ config_upstreams_init(struct config_upstreams *upstreams) {
 
     if (upstreams->pools == NULL) {
         string_deinit(&upstreams->schedule);
+        string_deinit(&upstreams->hash_key);
+        string_deinit(&upstreams->check_target);
         return RPS_ENOMEM;
     }
 
@@ -159,6 +180,8 @@ config_upstreams_init(struct config_upstreams *upstreams) {
 static void
 config_upstreams_deinit(struct config_upstreams *upstreams) {
     string_deinit(&upstreams->schedule);
+    string_deinit(&upstreams->hash_key);
+    string_deinit(&upstreams->check_target);
     while (array_n(upstreams->pools)) {
         config_upstream_deinit((struct config_upstream *)array_pop(upstreams->pools));
     }
@@ -211,6 +234,8 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
     struct config_server *server;
     struct config_upstream *upstream;
     int _bool;
+    long _long;
+    char *end;
 
     status = RPS_OK;
 
@@ -235,6 +260,10 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->servers.rtimeout = (atoi((char *)val->data)) * 1000;
         } else if (rps_strcmp(key, "ftimeout") == 0){
             cfg->servers.ftimeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "stats") == 0){
+            cfg->servers.stats = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "buffer_cap") == 0){
+            cfg->servers.buffer_cap = atoi((char *)val->data);
         } else {
             status = RPS_ERROR;
         }
@@ -250,6 +279,36 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             status = string_copy(&server->username, val);
         } else if (rps_strcmp(key, "password") == 0) {
             status = string_copy(&server->password, val);
+        } else if (rps_strcmp(key, "workers") == 0) {
+            errno = 0;
+            _long = strtol((char *)val->data, &end, 10);
+            if (errno != 0 || end == (char *)val->data || *end != '\0' ||
+                    _long < 1 || _long > SERVER_MAX_WORKERS) {
+                log_stderr("config: workers must be in 1..%d", SERVER_MAX_WORKERS);
+                status = RPS_ERROR;
+            } else {
+                server->workers = (uint16_t)_long;
+            }
+        } else if (rps_strcmp(key, "dispatch") == 0) {
+            if (rps_strcmp(val, "reuseport") != 0 && rps_strcmp(val, "acceptor") != 0) {
+                status = RPS_ERROR;
+            } else {
+                status = string_copy(&server->dispatch, val);
+            }
+        } else if (rps_strcmp(key, "splice") == 0) {
+            _bool = config_parse_bool(val);
+            if (_bool < 0) {
+                status  = RPS_ERROR;
+            } else {
+                server->splice = (unsigned)_bool;
+            }
+        } else if (rps_strcmp(key, "io_uring") == 0) {
+            _bool = config_parse_bool(val);
+            if (_bool < 0) {
+                status  = RPS_ERROR;
+            } else {
+                server->io_uring = (unsigned)_bool;
+            }
         } else {
             status = RPS_ERROR;
         }
@@ -260,6 +319,14 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->upstreams.stats = (atoi((char *)val->data)) * 1000;
         } else if (rps_strcmp(key, "schedule") == 0) {
             status = string_copy(&cfg->upstreams.schedule, val);
+        } else if (rps_strcmp(key, "hash_key") == 0) {
+            if (rps_strcmp(val, "user") == 0) {
+                /* credential is per listener yet, all sessions would share one key */
+                log_stderr("config: hash_key 'user' is not supported yet");
+                status = RPS_ERROR;
+            } else {
+                status = string_copy(&cfg->upstreams.hash_key, val);
+            }
         } else if (rps_strcmp(key, "hybrid") == 0) {
             _bool = config_parse_bool(val);
             if (_bool < 0) {
@@ -279,6 +346,39 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->upstreams.mr1d = atoi((char *)val->data);
         } else if (rps_strcmp(key, "max_fail_rate") == 0) { 
             cfg->upstreams.max_fail_rate = atof((char *)val->data);
+        } else if (rps_strcmp(key, "health_halflife") == 0) { 
+            cfg->upstreams.health_halflife = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "warm") == 0) { 
+            cfg->upstreams.warm = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "warm_idle") == 0) { 
+            cfg->upstreams.warm_idle = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "hedge") == 0) {
+            _bool = config_parse_bool(val);
+            if (_bool < 0) {
+                status  = RPS_ERROR;
+            } else {
+                cfg->upstreams.hedge = (unsigned)_bool;
+            }
+        } else if (rps_strcmp(key, "hedge_delay") == 0) { 
+            cfg->upstreams.hedge_delay = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "breaker") == 0) { 
+            cfg->upstreams.breaker = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "breaker_backoff") == 0) { 
+            cfg->upstreams.breaker_backoff = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "check_interval") == 0) { 
+            cfg->upstreams.check_interval = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "check_concurrency") == 0) { 
+            errno = 0;
+            _long = strtol((char *)val->data, &end, 10);
+            if (errno != 0 || end == (char *)val->data || *end != '\0' ||
+                    _long < 0 || _long > UINT32_MAX) {
+                log_stderr("config: invalid check_concurrency");
+                status = RPS_ERROR;
+            } else {
+                cfg->upstreams.check_concurrency = (uint32_t)_long;
+            }
+        } else if (rps_strcmp(key, "check_target") == 0) {
+            status = string_copy(&cfg->upstreams.check_target, val);
         } else {
             status = RPS_ERROR;
         }
@@ -619,6 +719,17 @@ config_end_parse(struct config *cfg) {
     return RPS_OK;
 }
 
+/* Options depend on each other, checked once all be parsed */
+static rps_status_t
+config_check(struct config *cfg) {
+    if (cfg->upstreams.check_interval > 0 && cfg->upstreams.check_concurrency == 0) {
+        log_stderr("config: check_concurrency must be positive when health check enabled");
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+
 static rps_status_t
 config_parse(struct config *cfg){
     rps_status_t status;
@@ -638,6 +749,11 @@ config_parse(struct config *cfg){
     if (status != RPS_OK) {
         return status;
     }
+
+    status = config_check(cfg);
+    if (status != RPS_OK) {
+        return status;
+    }
     
     return RPS_OK;
 }
@@ -651,6 +767,10 @@ config_dump_server(void *data) {
     log_debug("\t   port: %d", server->port);
     log_debug("\t   username: %s", server->username.data);
     log_debug("\t   password: %s", server->password.data);
+    log_debug("\t   workers: %d", server->workers);
+    log_debug("\t   dispatch: %s", server->dispatch.data);
+    log_debug("\t   splice: %d", server->splice);
+    log_debug("\t   io_uring: %d", server->io_uring);
     log_debug("");
 }
 
@@ -671,11 +791,14 @@ config_dump(struct config *cfg) {
     log_debug("[servers]");
     log_debug("\t rtimeout: %d", cfg->servers.rtimeout);
     log_debug("\t ftimeout: %d", cfg->servers.ftimeout);
+    log_debug("\t stats: %d", cfg->servers.stats);
+    log_debug("\t buffer_cap: %d", cfg->servers.buffer_cap);
     log_debug("");
     array_foreach(cfg->servers.ss, config_dump_server);
 
     log_debug("[upstreams]");
     log_debug("\t schedule: %s", cfg->upstreams.schedule.data);
+    log_debug("\t hash_key: %s", cfg->upstreams.hash_key.data);
     log_debug("\t refresh: %d", cfg->upstreams.refresh/1000);
     log_debug("\t stats: %d", cfg->upstreams.stats/1000);
     log_debug("\t hybrid: %d", cfg->upstreams.hybrid);
@@ -685,6 +808,16 @@ config_dump(struct config *cfg) {
     log_debug("\t mr1h: %d", cfg->upstreams.mr1h);
     log_debug("\t mr1d: %d", cfg->upstreams.mr1d);
     log_debug("\t max_fail_rate: %.2f", cfg->upstreams.max_fail_rate);
+    log_debug("\t health_halflife: %d", cfg->upstreams.health_halflife/1000);
+    log_debug("\t warm: %d", cfg->upstreams.warm);
+    log_debug("\t warm_idle: %d", cfg->upstreams.warm_idle/1000);
+    log_debug("\t hedge: %d", cfg->upstreams.hedge);
+    log_debug("\t hedge_delay: %d", cfg->upstreams.hedge_delay);
+    log_debug("\t breaker: %d", cfg->upstreams.breaker);
+    log_debug("\t breaker_backoff: %d", cfg->upstreams.breaker_backoff/1000);
+    log_debug("\t check_interval: %d", cfg->upstreams.check_interval/1000);
+    log_debug("\t check_concurrency: %d", cfg->upstreams.check_concurrency);
+    log_debug("\t check_target: %s", cfg->upstreams.check_target.data);
     log_debug("");
     array_foreach(cfg->upstreams.pools, config_dump_upstream);
 
@@ -18,11 +18,30 @@
 #define UPSTREAM_DEFAULT_MR1H   0
 #define UPSTREAM_DEFAULT_MR1D   0
 #define UPSTREAM_DEFAULT_MAX_FIAL_RATE  0.0
+#define UPSTREAM_DEFAULT_HEALTH_HALFLIFE    300
+#define UPSTREAM_DEFAULT_WARM       0
+#define UPSTREAM_DEFAULT_WARM_IDLE  10
+#define UPSTREAM_DEFAULT_HEDGE      0
+#define UPSTREAM_DEFAULT_HEDGE_DELAY    500
+#define UPSTREAM_DEFAULT_BREAKER    0
+#define UPSTREAM_DEFAULT_BREAKER_BACKOFF    10
+#define UPSTREAM_DEFAULT_CHECK_INTERVAL     0
+#define UPSTREAM_DEFAULT_CHECK_CONCURRENCY  16
+
+#define SERVER_DEFAULT_WORKERS  1
+#define SERVER_MAX_WORKERS      64
+#define SERVER_DEFAULT_DISPATCH "reuseport"
+#define SERVER_DEFAULT_SPLICE   0
+#define SERVER_DEFAULT_IO_URING 0
+#define SERVER_DEFAULT_STATS    0
+#define SERVER_DEFAULT_BUFFER_CAP   0
 
 struct config_servers {
     rps_array_t     *ss;
     uint32_t        rtimeout;
     uint32_t        ftimeout;
+    uint32_t        stats;      /* interval of logging loop stats */
+    uint32_t        buffer_cap; /* MB of buffers per worker loop */
 };
 
 struct config_server {
@@ -31,6 +50,10 @@ struct config_server {
     uint16_t        port;
     rps_str_t       username;
     rps_str_t       password;
+    uint16_t        workers;
+    rps_str_t       dispatch;
+    unsigned        splice:1;
+    unsigned        io_uring:1;
 };
 
 struct config_upstream {
@@ -41,6 +64,7 @@ struct config_upstreams {
     uint32_t        refresh;
     uint32_t        stats;
     rps_str_t       schedule;
+    rps_str_t       hash_key;
     unsigned        hybrid:1;
     uint32_t        maxreconn;
     uint32_t        maxretry;
@@ -48,6 +72,16 @@ struct config_upstreams {
     uint32_t        mr1h;
     uint32_t        mr1d;
     float           max_fail_rate;
+    uint32_t        health_halflife;    /* ms the outcome scores take to halve */
+    uint32_t        warm;       /* idle connections kept ready per upstream */
+    uint32_t        warm_idle;  /* ms a warm connection stay idle before refresh */
+    unsigned        hedge:1;
+    uint32_t        hedge_delay;    /* ms, floor of the adaptive hedge delay */
+    uint32_t        breaker;    /* consecutive failures to open circuit breaker */
+    uint32_t        breaker_backoff;    /* ms an opened breaker wait before half open */
+    uint32_t        check_interval;     /* ms between health check rounds, 0 disable */
+    uint32_t        check_concurrency;  /* probes in flight per server loop */
+    rps_str_t       check_target;       /* host:port the probes connect through upstreams */
     rps_array_t     *pools;
 };
 
@@ -2,6 +2,8 @@
 #define _RPS_CORE_H
 
 
+#include "buffer.h"
+
 #include <uv.h>
 #include <string.h>
 #include <stdint.h>
@@ -13,9 +15,17 @@
 #define RPS_EUPSTREAM   -3
 #define RPS_EQUEUE   -4
 
-#define READ_BUF_SIZE 2048 //2k
-#define WRITE_BUF_SIZE 65536 //64k
-#define WRITE_UV_BUF_SIZE   20
+#define READ_BUF_SIZE 2048 //2k, initial and minimal read buffer
+#define READ_BUF_MAX_SIZE 65536 //64k
+#define READ_BUF_SHRINK_READS   4 /* mostly empty reads before shrink */
+#define WRITE_UV_BUF_SIZE   20  /* max chunks per uv_write */
+
+/* Relay reads no larger than this be copied into the tail chunk of queue */
+#define WRITE_COALESCE_SIZE     4096
+
+/* Pause the relay source once pending bytes reach high, resume under low */
+#define WRITE_HIGH_WATERMARK    (128 * 1024)
+#define WRITE_LOW_WATERMARK     (32 * 1024)
 
 #define UNDEFINED_REPLY_CODE -1
 
@@ -152,18 +162,27 @@ struct context {
 
     rps_proto_t         proto;
 
-    char                rbuf[READ_BUF_SIZE];
+    /* Read chunk borrowed from server buffer pool, sized by recent reads. 
+     * rbuf points to its data, relay may hand the chunk over to endpoint's 
+     * output queue instead of copying.
+     */
+    struct chunk        *rchunk;
+    char                *rbuf;
+    size_t              rsize;
+    size_t              rwant;
+    uint8_t             rshrink;
     ssize_t             nread;
 
-    char                *wbuf;
-    ssize_t             nwrite;
-
     /* The memory pointed to by the buffers must remain valid until the write callback gets called.
-     * So we use a buffer for write buffer ensure the wbuf is safe 
-     * and won't be overwritten before write callback called.
+     * So pending data be kept in the output queue and only be released 
+     * after write callback called.
      */
-    char                *wbuf2;
-    ssize_t             nwrite2;
+    struct chunk_queue  wq;
+    size_t              nwrite; /* bytes in flight of write_req */
+
+    /* io_uring requests in flight, the engine relay established tunnel */
+    struct server_uring_op *urecv;
+    struct server_uring_op *usend;
 
     rps_addr_t          peer;
     char                peername[MAX_INET_ADDRSTRLEN];
@@ -185,6 +204,9 @@ struct context {
     int                 reply_code;
 
     int                 last_status;
+
+    uint64_t            relayed; /* bytes relayed from this context to endpoint */
+
     uint16_t            reconn;
     uint16_t            retry;
 
@@ -199,6 +221,14 @@ struct context {
     uint8_t             connecting:1;
     uint8_t             connected:1;
     uint8_t             established:1;
+    uint8_t             paused:1;   /* read stopped by endpoint backpressure */
+    uint8_t             wshutdown:1;/* shutdown deferred until output queue drained */
+    uint8_t             uring:1;    /* read and write through io_uring of the loop */
+    uint8_t             reof:1;     /* peer half-closed, nothing more to read */
+    uint8_t             wclosed:1;  /* write side has been shut down */
+    uint8_t             warm:1;     /* parked in warm stock, no session owns it */
+    uint8_t             hedge:1;    /* second attempt of session, not the forward */
+    uint8_t             probe:1;    /* upstream health probe, no client behind it */
 };
 
 struct session {
@@ -209,6 +239,17 @@ struct session {
 
     struct upstream *upstream;
 
+    /* Phase timestamps in loop time (ms), 0 while the phase not reached */
+    uint64_t        accepted;
+    uint64_t        connect_start;  /* start connect upstream */
+    uint64_t        connected;      /* upstream tcp connected */
+    uint64_t        established;    /* upstream handshake done */
+    uint64_t        first_byte;     /* first byte from remote relayed */
+    uint64_t        finished;
+
+    struct server_splice *splice;   /* kernel relay of established tunnel */
+    struct server_hedge *hedge;     /* second attempt racing the forward */
+
     struct timeval  start;
     struct timeval  end; 
 
@@ -1149,15 +1149,70 @@ http_header_message(char *message, int size, struct hashmap_entry *header) {
     return len;
 }
 
+/* Bytes of the formatted headers, the bound of http_header_message */
+static size_t
+http_headers_message_size(rps_hashmap_t *headers) {
+    size_t size;
+    uint32_t i;
+    struct hashmap_entry *header;
+
+    size = 0;
+
+    for (i = 0; i < headers->size; i++) {
+        for (header = headers->buckets[i]; header != NULL; header = header->next) {
+            size += header->key_size + header->value_size + 4; /* ": " and CRLF */
+        }
+    }
+
+    return size;
+}
+
+/* Buffer size fit the formatted head, terminating nul included */
+size_t
+http_response_message_size(struct http_response *resp) {
+    return resp->version.len + resp->status.len + 16 + 
+        http_headers_message_size(&resp->headers) + 3;
+}
+
+size_t
+http_request_message_size(struct http_request *req) {
+    size_t size;
+
+    size = strlen(http_method_str(req->method)) + req->version.len + 16;
+    size += req->method == http_connect ? req->host.len : req->full_uri.len;
+
+    return size + http_headers_message_size(&req->headers) + 3;
+}
+
+/* 
+ * A pool buffer to format the head of *size bytes in, *size is rounded up
+ * to the class size. NULL if the head is larger than any buffer, or the
+ * buffer memory cap is reached.
+ */
+char *
+http_message_get(struct context *ctx, size_t *size) {
+    if (*size > BUFFER_MAX_SIZE) {
+        log_warn("http message head to %s too large, %zu bytes", ctx->peername, *size);
+        return NULL;
+    }
+
+    *size = buffer_size(*size);
+
+    return buffer_get(&ctx->sess->server->buffers, *size);
+}
+
+void
+http_message_put(struct context *ctx, char *message, size_t size) {
+    buffer_put(&ctx->sess->server->buffers, message, size);
+}
+
 int
-http_response_message(char *message, struct http_response *resp) {
+http_response_message(char *message, size_t size, struct http_response *resp) {
     int len;
-    int size;
     uint32_t i;
     struct hashmap_entry *header;
 
     len = 0;
-    size = HTTP_MESSAGE_MAX_LENGTH;
 
     len += snprintf(message, size, "%s %d %s\r\n", 
             resp->version.data, resp->code, resp->status.data);
@@ -1173,9 +1228,7 @@ http_response_message(char *message, struct http_response *resp) {
 
     len += snprintf(message + len, size - len, "\r\n");
 
-    if (!string_empty(&resp->body)) {
-        len += snprintf(message + len, size - len, "%s", resp->body.data);
-    }
+    /* body be sent as a separate write segment, see http_send_message */
     
 #ifdef RPS_DEBUG_OPEN
     http_response_dump(resp, http_send);
@@ -1185,14 +1238,12 @@ http_response_message(char *message, struct http_response *resp) {
 }
 
 int 
-http_request_message(char *message, struct http_request *req) {
+http_request_message(char *message, size_t size, struct http_request *req) {
     int len;
-    int size;
     uint32_t i;
     struct hashmap_entry *header;
 
     len = 0;
-    size = HTTP_MESSAGE_MAX_LENGTH;
 
     if (req->method == http_connect) {
         len += snprintf(message, size, "%s %s:%d %s\r\n", 
@@ -1216,9 +1267,7 @@ http_request_message(char *message, struct http_request *req) {
 
     len += snprintf(message + len, size - len, "\r\n");
 
-    if (!string_empty(&req->body)) {
-        len += snprintf(message + len, size - len, "%s", req->body.data);
-    }
+    /* body be sent as a separate write segment, see http_send_message */
 
 #ifdef RPS_DEBUG_OPEN
     http_request_dump(req, http_send);
@@ -1386,13 +1435,31 @@ http_response_verify(struct context *ctx) {
 }
 
 
+/* Send the message head and body without flattening them into one buffer */
+rps_status_t
+http_send_message(struct context *ctx, char *head, size_t len, rps_str_t *body) {
+    uv_buf_t bufs[2];
+    unsigned int nbufs;
+
+    bufs[0] = uv_buf_init(head, len);
+    nbufs = 1;
+
+    if (!string_empty(body)) {
+        bufs[1] = uv_buf_init((char *)body->data, body->len);
+        nbufs++;
+    }
+
+    return server_writev(ctx, bufs, nbufs);
+}
+
 rps_status_t
 http_send_request(struct context *ctx) {
     struct http_request *req;
     struct upstream *u;
-    size_t i;
-    char message[HTTP_MESSAGE_MAX_LENGTH];
+    size_t i, size;
+    char *message;
     int len;
+    rps_status_t status;
 
     req = ctx->sess->request->req;
 
@@ -1436,19 +1503,29 @@ http_send_request(struct context *ctx) {
             (void *)val4, strlen(val4));    
     }
     
-    len = http_request_message(message, req);
+    size = http_request_message_size(req);
+    message = http_message_get(ctx, &size);
+    if (message == NULL) {
+        return RPS_ENOMEM;
+    }
 
-    ASSERT(len > 0);
+    len = http_request_message(message, size, req);
+
+    ASSERT(len > 0 && (size_t)len < size);
+
+    status = http_send_message(ctx, message, len, &req->body);
 
-    return server_write(ctx, message, len);
+    http_message_put(ctx, message, size);
+
+    return status;
 
 }
 
 rps_status_t
 http_send_response(struct context *ctx, uint16_t code) {
     struct http_response resp;
-    size_t len;
-    char message[HTTP_MESSAGE_MAX_LENGTH];
+    size_t len, size;
+    char *message;
 
     ASSERT(http_valid_code(code));
 
@@ -1536,11 +1613,23 @@ http_send_response(struct context *ctx, uint16_t code) {
     
 #endif
 
-    len = http_response_message(message, &resp);
+    rps_status_t status;
+
+    size = http_response_message_size(&resp);
+    message = http_message_get(ctx, &size);
+    if (message == NULL) {
+        http_response_deinit(&resp);
+        return RPS_ENOMEM;
+    }
+
+    len = http_response_message(message, size, &resp);
     
-    ASSERT(len > 0);
+    ASSERT(len > 0 && len < size);
+
+    status = http_send_message(ctx, message, len, &resp.body);
 
+    http_message_put(ctx, message, size);
     http_response_deinit(&resp);
 
-    return server_write(ctx, message, len);
+    return status;
 }
@@ -13,7 +13,6 @@
 
 #define HTTP_BODY_MAX_LENGTH    2048
 // 1M is big enough in our approach
-#define HTTP_MESSAGE_MAX_LENGTH    1024 * 1024
 
 #define HTTP_MIN_STATUS_CODE    100
 #define HTTP_MAX_STATUS_CODE    599
@@ -199,11 +198,16 @@ void http_request_dump(struct http_request *req, uint8_t rs);
 void http_response_dump(struct http_response *resp, uint8_t rs);
 #endif
 
-int http_request_message(char *message, struct http_request *req);
-int http_response_message(char *message, struct http_response *resp);
+size_t http_request_message_size(struct http_request *req);
+size_t http_response_message_size(struct http_response *resp);
+int http_request_message(char *message, size_t size, struct http_request *req);
+int http_response_message(char *message, size_t size, struct http_response *resp);
+char *http_message_get(struct context *ctx, size_t *size);
+void http_message_put(struct context *ctx, char *message, size_t size);
 
 int http_request_verify(struct context *ctx);
 int http_response_verify(struct context *ctx);
+rps_status_t http_send_message(struct context *ctx, char *head, size_t len, rps_str_t *body);
 rps_status_t http_send_response(struct context *ctx, uint16_t code);
 rps_status_t http_send_request(struct context *ctx);
 
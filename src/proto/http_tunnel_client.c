@@ -6,9 +6,10 @@ static rps_status_t
 http_tunnel_send_request(struct context *ctx) {
     struct http_request *req, nreq;
     struct upstream *u;
-    size_t i;
-    char message[HTTP_MESSAGE_MAX_LENGTH];
+    size_t i, size;
+    char *message;
     int len;
+    rps_status_t status;
 
     req = ctx->sess->request->req;
 
@@ -63,13 +64,24 @@ http_tunnel_send_request(struct context *ctx) {
 #endif
     
     
-    len = http_request_message(message, &nreq);
+    size = http_request_message_size(&nreq);
+    message = http_message_get(ctx, &size);
+    if (message == NULL) {
+        http_request_deinit(&nreq);
+        return RPS_ENOMEM;
+    }
+
+    len = http_request_message(message, size, &nreq);
 
-    ASSERT(len > 0);
+    ASSERT(len > 0 && (size_t)len < size);
 
     http_request_deinit(&nreq);
 
-    return server_write(ctx, message, len);
+    status = server_write(ctx, message, len);
+
+    http_message_put(ctx, message, size);
+
+    return status;
 }
 
 static void
@@ -226,32 +226,70 @@ rps_set_log(struct application *app) {
 static rps_status_t
 rps_server_load(struct application *app) {
     uint32_t i, n;
+    uint16_t j;
     rps_status_t status;
     struct config_server *cfg;
-    struct server *s;
+    struct server *s, *workers;
 
 	array_null(&app->servers);
 
-    n = array_n(app->cfg.servers.ss);
+    /* each worker of the listener run a server with its own loop, 
+     * an extra acceptor server is needed in acceptor dispatch mode.
+     */
+    n = 0;
+    for (i = 0; i < array_n(app->cfg.servers.ss); i++) {
+        cfg = (struct config_server *)array_get(app->cfg.servers.ss, i);
+        n += cfg->workers;
+        if (server_acceptor_dispatch(cfg)) {
+            n += 1;
+        }
+    }
 
     status = array_init(&app->servers, n , sizeof(struct server));   
     if (status != RPS_OK) {
         return status;
     }
     
-    for (i = 0; i < n; i++) {
+    for (i = 0; i < array_n(app->cfg.servers.ss); i++) {
         cfg = (struct config_server *)array_get(app->cfg.servers.ss, i);
+
+        workers = NULL;
+
+        for (j = 0; j < cfg->workers; j++) {
+            s = (struct server *)array_push(&app->servers);
+            if (s == NULL) {
+                goto error;
+            }
+            
+            status = server_init(s, &app->cfg.servers, cfg, &app->upstreams, j);
+            if (status != RPS_OK) {
+                goto error;
+            }
+
+            if (workers == NULL) {
+                workers = s;
+            }
+        }
+
+        if (!server_acceptor_dispatch(cfg)) {
+            continue;
+        }
+
+        /* servers array is preallocated, workers are contiguous and never move */
         s = (struct server *)array_push(&app->servers);
         if (s == NULL) {
             goto error;
         }
-        
-        status = server_init(s, cfg, &app->upstreams, 
-                app->cfg.servers.rtimeout, app->cfg.servers.ftimeout);
+
+        status = server_init(s, &app->cfg.servers, cfg, &app->upstreams, cfg->workers);
         if (status != RPS_OK) {
             goto error;
         }
 
+        status = server_dispatch_init(s, workers, cfg->workers);
+        if (status != RPS_OK) {
+            goto error;
+        }
     }
     
     return RPS_OK;
@@ -377,13 +415,18 @@ rps_run(struct application *app) {
     uv_thread_t *tid;
     rps_array_t threads;
 
-    upstreams_init(&app->upstreams, &app->cfg.api, &app->cfg.upstreams);
-
     status = rps_server_load(app);
     if (status != RPS_OK) {
         return;
     }
 
+    /* every server thread read upstreams */
+    status = upstreams_init(&app->upstreams, &app->cfg.api, &app->cfg.upstreams, 
+            array_n(&app->servers));
+    if (status != RPS_OK) {
+        return;
+    }
+
     n = array_n(&app->servers) + 1; // Add 1 upstream auto-refresh thread
     
     status = array_init(&threads, n , sizeof(uv_thread_t));   
@@ -7,13 +7,65 @@
 #include "proto/http_proxy.h"
 #include "proto/http_tunnel.h"
 
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef SPLICE_F_MOVE
+#include <sys/epoll.h>
+#endif
+
+#ifdef RPS_HAVE_IO_URING
+/* A recv or send request of context in flight on the loop's ring */
+enum server_uring_op_type {
+    u_recv,
+    u_send,
+};
+
+struct server_uring_op {
+    rps_ctx_t       *ctx;   /* NULL once the context be closed */
+    uint8_t         type;
+    unsigned int    n;
+    struct chunk    *chunks[WRITE_UV_BUF_SIZE]; /* referenced until completion */
+    uv_buf_t        bufs[WRITE_UV_BUF_SIZE];    /* same layout as struct iovec */
+    struct msghdr   msg;
+};
+
+static void server_uring_detach(rps_ctx_t *ctx);
+static rps_status_t server_uring_recv(rps_ctx_t *ctx);
+static rps_status_t server_uring_send(rps_ctx_t *ctx);
+#endif
+
+/*
+ * Hedged connect of session, armed at the first connect attempt and started
+ * once the forward hasn't been established within the hedge delay. The
+ * attempt runs in a shadow session sharing owner's request and remote, the 
+ * winner be swapped into owner and the loser be closed from the shadow.
+ */
+struct server_hedge {
+    rps_sess_t          sess;   /* shadow session */
+    rps_sess_t          *owner; /* NULL once resolved */
+    rps_ctx_t           *ctx;   /* NULL while armed */
+    uint64_t            at;     /* loop time to start */
+    struct server_hedge *prev;
+    struct server_hedge *next;
+};
+
+static void server_hedge_cancel(rps_sess_t *sess);
+
 
 rps_status_t
-server_init(struct server *s, struct config_server *cfg, 
-        struct upstreams *us, uint32_t rtimeout, uint32_t ftimeout) {
+server_init(struct server *s, struct config_servers *css, 
+        struct config_server *cfg, struct upstreams *us, uint16_t worker) {
     int err;
     int status;
 
+#ifndef SO_REUSEPORT
+    if (cfg->workers > 1 && !server_acceptor_dispatch(cfg)) {
+        log_error("SO_REUSEPORT unsupported, %s proxy can only run 1 worker", cfg->proto.data);
+        return RPS_ERROR;
+    }
+#endif
+
     err = uv_loop_init(&s->loop);
     if (err != 0) {
         UV_SHOW_ERROR(err, "loop init");
@@ -43,9 +95,105 @@ server_init(struct server *s, struct config_server *cfg,
 
     s->cfg = cfg;
     s->upstreams = us;
-    s->rtimeout = rtimeout;
-    s->ftimeout = ftimeout;
+    s->rtimeout = css->rtimeout;
+    s->ftimeout = css->ftimeout;
+    s->stats = css->stats;
+    memset(&s->metrics, 0, sizeof(s->metrics));
     s->conn_count = 0;
+    s->worker = worker;
+    s->role = s_standalone;
+    s->workers = NULL;
+    s->nworkers = 0;
+    s->dispatched = 0;
+    s->accepted = 0;
+    s->warm = NULL;
+    s->nwarm = 0;
+    s->hedge_head = NULL;
+    s->hedge_tail = NULL;
+    s->nsetup = 0;
+    s->hedge_delay = 0;
+    s->prober = 0;
+    s->probe_cursor = 0;
+    s->nprobe = 0;
+    s->probing = 0;
+
+    buffer_pool_init(&s->buffers, BUFFER_POOL_DEFAULT_LIMIT, 
+            (size_t)css->buffer_cap * 1024 * 1024);
+    object_pool_init(&s->sessions, sizeof(struct session), SERVER_SESSION_POOL_MAX);
+    object_pool_init(&s->contexts, sizeof(struct context), SERVER_CONTEXT_POOL_MAX);
+    object_pool_init(&s->hedges, sizeof(struct server_hedge), SERVER_HEDGE_POOL_MAX);
+
+#ifdef SPLICE_F_MOVE
+    s->splice = cfg->splice;
+#else
+    if (cfg->splice) {
+        log_warn("splice unsupported, %s proxy fall back to buffered relay", cfg->proto.data);
+    }
+    s->splice = 0;
+#endif
+
+#ifdef RPS_HAVE_IO_URING
+    if (cfg->io_uring && s->splice) {
+        log_warn("splice enabled, %s proxy ignore io_uring", cfg->proto.data);
+    }
+    s->io_uring = cfg->io_uring && !s->splice;
+    object_pool_init(&s->uring_ops, sizeof(struct server_uring_op), SERVER_URING_OP_POOL_MAX);
+#else
+    if (cfg->io_uring) {
+        log_warn("io_uring unsupported, %s proxy fall back to libuv relay", cfg->proto.data);
+    }
+    s->io_uring = 0;
+#endif
+
+    return RPS_OK;
+}
+
+rps_status_t
+server_dispatch_init(struct server *acceptor, struct server *workers, uint16_t n) {
+    int fds[2];
+    int err;
+    uint16_t i;
+    struct server *w;
+
+    ASSERT(n > 0);
+
+    for (i = 0; i < n; i++) {
+        w = &workers[i];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            log_error("create dispatch channel failed: %s", strerror(errno));
+            return RPS_ERROR;
+        }
+
+        err = uv_pipe_init(&w->loop, &w->ipc, 1);
+        if (!err) {
+            err = uv_pipe_open(&w->ipc, fds[0]);
+        }
+        if (err) {
+            UV_SHOW_ERROR(err, "open dispatch receive channel");
+            close(fds[0]);
+            close(fds[1]);
+            return RPS_ERROR;
+        }
+
+        err = uv_pipe_init(&acceptor->loop, &w->dispatcher, 1);
+        if (!err) {
+            err = uv_pipe_open(&w->dispatcher, fds[1]);
+        }
+        if (err) {
+            UV_SHOW_ERROR(err, "open dispatch send channel");
+            close(fds[1]);
+            return RPS_ERROR;
+        }
+
+        w->ipc.data = w;
+        w->dispatcher.data = w;
+        w->role = s_worker;
+    }
+
+    acceptor->role = s_acceptor;
+    acceptor->workers = workers;
+    acceptor->nworkers = n;
 
     return RPS_OK;
 }
@@ -55,6 +203,18 @@ void
 server_deinit(struct server *s) {
     uv_loop_close(&s->loop);
 
+    buffer_pool_deinit(&s->buffers);
+    object_pool_deinit(&s->sessions);
+    object_pool_deinit(&s->contexts);
+    object_pool_deinit(&s->hedges);
+
+#ifdef RPS_HAVE_IO_URING
+    if (s->io_uring) {
+        uring_deinit(&s->ring);
+    }
+    object_pool_deinit(&s->uring_ops);
+#endif
+
     /* Make valgrind happy */
     uv_loop_delete(&s->loop);
 }
@@ -65,6 +225,14 @@ server_sess_init(rps_sess_t *sess, struct server *s) {
     sess->request = NULL;
     sess->forward = NULL;
     sess->upstream = NULL;
+    sess->accepted = uv_now(&s->loop);
+    sess->connect_start = 0;
+    sess->connected = 0;
+    sess->established = 0;
+    sess->first_byte = 0;
+    sess->finished = 0;
+    sess->splice = NULL;
+    sess->hedge = NULL;
     rps_addr_init(&sess->remote);
     gettimeofday(&sess->start, NULL);
 }
@@ -80,7 +248,9 @@ server_sess_upstream_mark_fail(rps_sess_t *sess) {
         return;
     }
 
-    sess->upstream->failure += 1;
+    upstreams_mark_failure(sess->server->upstreams, sess->upstream, 
+            (uint32_t)(uv_now(&sess->server->loop) - sess->connect_start),
+            sess->established != 0);
 
     request = sess->request;
     forward = sess->forward;
@@ -94,6 +264,63 @@ server_sess_upstream_mark_fail(rps_sess_t *sess) {
             remoteip, rps_unresolve_port(&sess->remote), forward->retry, forward->reconn);
 }
 
+/* Milliseconds between two phase timestamps, 0 while any not reached */
+static uint32_t
+server_sess_phase(uint64_t from, uint64_t to) {
+    return (from != 0 && to >= from) ? (uint32_t)(to - from) : 0;
+}
+
+static uint64_t
+server_sess_bytes_up(rps_sess_t *sess) {
+    return sess->request != NULL ? sess->request->relayed : 0;
+}
+
+static uint64_t
+server_sess_bytes_down(rps_sess_t *sess) {
+    return sess->forward != NULL ? sess->forward->relayed : 0;
+}
+
+/* Fold the finished session into server metrics and upstream stats, only once */
+static void
+server_sess_account(rps_sess_t *sess) {
+    struct server_metrics *m;
+    uint64_t up, down;
+    uint32_t elapsed;
+
+    if (sess->finished != 0) {
+        return;
+    }
+
+    sess->finished = uv_now(&sess->server->loop);
+
+    up = server_sess_bytes_up(sess);
+    down = server_sess_bytes_down(sess);
+
+    m = &sess->server->metrics;
+    m->sessions++;
+    m->bytes_up += up;
+    m->bytes_down += down;
+
+    if (sess->established == 0) {
+        return;
+    }
+
+    elapsed = server_sess_phase(sess->established, sess->finished);
+
+    m->established++;
+    m->t_accept += server_sess_phase(sess->accepted, sess->connect_start);
+    m->t_connect += server_sess_phase(sess->connect_start, sess->connected);
+    m->t_handshake += server_sess_phase(sess->connected, sess->established);
+    m->t_established += elapsed;
+
+    if (sess->first_byte != 0) {
+        m->first_byte++;
+        m->t_first_byte += server_sess_phase(sess->established, sess->first_byte);
+    }
+
+    upstreams_mark_transfer(sess->server->upstreams, sess->upstream, up + down, elapsed);
+}
+
 static void
 server_sess_mark_fail(rps_sess_t *sess) {
     float elapsed;
@@ -106,6 +333,9 @@ server_sess_mark_fail(rps_sess_t *sess) {
         return;
     }
 
+    /* Transfer be accounted first, marking fail releases the upstream */
+    server_sess_account(sess);
+
     server_sess_upstream_mark_fail(sess);
 
     gettimeofday (&sess->end, NULL);
@@ -119,10 +349,13 @@ server_sess_mark_fail(rps_sess_t *sess) {
     } else {
         rps_unresolve_addr(&sess->remote, remoteip);        
         
-        log_info("%s:%d -> rps:%d -> upstream -> %s:%d failed, used %.2f s'",
+        log_info("%s:%d -> rps:%d -> upstream -> %s:%d failed, used %.2f s', "
+                "up %llu bytes, down %llu bytes",
                 request->peername, rps_unresolve_port(&request->peer), 
                 rps_unresolve_port(&sess->server->listen), 
-                remoteip, rps_unresolve_port(&sess->remote), elapsed);
+                remoteip, rps_unresolve_port(&sess->remote), elapsed,
+                (unsigned long long)server_sess_bytes_up(sess), 
+                (unsigned long long)server_sess_bytes_down(sess));
     }
 }
 
@@ -135,7 +368,10 @@ server_sess_mark_success(rps_sess_t *sess) {
     request = sess->request;
     forward = sess->forward;
 
-    sess->upstream->success += 1;
+    /* Transfer be accounted first, marking success releases the upstream */
+    server_sess_account(sess);
+
+    upstreams_mark_success(sess->server->upstreams, sess->upstream);
 
     gettimeofday (&sess->end, NULL);
     elapsed = (sess->end.tv_sec - sess->start.tv_sec) + 
@@ -143,23 +379,34 @@ server_sess_mark_success(rps_sess_t *sess) {
 
     rps_unresolve_addr(&sess->remote, remoteip);    
 
-    log_info("%s:%d -> rps:%d -> %s:%d -> %s:%d success, used %.2f s'",
+    log_info("%s:%d -> rps:%d -> %s:%d -> %s:%d success, used %.2f s', "
+            "up %llu bytes, down %llu bytes, accept %u ms, connect %u ms, "
+            "handshake %u ms, first byte %u ms",
             request->peername, rps_unresolve_port(&request->peer),
             rps_unresolve_port(&sess->server->listen), 
             forward->peername, rps_unresolve_port(&forward->peer), 
-            remoteip, rps_unresolve_port(&sess->remote), elapsed);
+            remoteip, rps_unresolve_port(&sess->remote), elapsed,
+            (unsigned long long)request->relayed, (unsigned long long)forward->relayed,
+            server_sess_phase(sess->accepted, sess->connect_start),
+            server_sess_phase(sess->connect_start, sess->connected),
+            server_sess_phase(sess->connected, sess->established),
+            server_sess_phase(sess->established, sess->first_byte));
 }
 
 
 static void
 server_sess_free(rps_sess_t *sess) {
+    struct server *s;
+
+    s = sess->server;
+
     if (((sess->request != NULL)) && (sess->request->state & c_closed)) {
-        rps_free(sess->request);
+        object_put(&s->contexts, sess->request);
         sess->request = NULL;
     }
 
     if ((sess->forward != NULL) && (sess->forward->state & c_closed)) {
-        rps_free(sess->forward);
+        object_put(&s->contexts, sess->forward);
         sess->forward = NULL;
     }
 
@@ -167,11 +414,12 @@ server_sess_free(rps_sess_t *sess) {
         return;
     }
 
-    if (sess->server->conn_count > 0) {
-        sess->server->conn_count--;
+    /* only the worker writes, the acceptor reads it for dispatch */
+    if (s->conn_count > 0) {
+        rps_atomic_store(&s->conn_count, s->conn_count - 1);
     }
     sess->upstream = NULL;
-    rps_free(sess);
+    object_put(&s->sessions, sess);
 }
 
 static rps_status_t
@@ -182,12 +430,27 @@ server_ctx_init(rps_ctx_t *ctx, rps_sess_t *sess, uint8_t flag, uint32_t timeout
     ctx->stream = -1;
     ctx->nread = 0;
     ctx->nwrite = 0;
-    ctx->nwrite2 = 0;
     ctx->reconn = 0;
     ctx->retry = 0;
     ctx->connecting = 0;
     ctx->connected = 0;
     ctx->established = 0;
+    ctx->paused = 0;
+    ctx->wshutdown = 0;
+    ctx->uring = 0;
+    ctx->reof = 0;
+    ctx->wclosed = 0;
+    ctx->warm = 0;
+    ctx->hedge = 0;
+    ctx->probe = 0;
+    ctx->urecv = NULL;
+    ctx->usend = NULL;
+    ctx->relayed = 0;
+    ctx->rchunk = NULL;
+    ctx->rbuf = NULL;
+    ctx->rsize = 0;
+    ctx->rwant = READ_BUF_SIZE;
+    ctx->rshrink = 0;
     ctx->c_count = 0;
     ctx->proto = UNSET;
     ctx->reply_code = rps_rep_undefined;
@@ -200,17 +463,8 @@ server_ctx_init(rps_ctx_t *ctx, rps_sess_t *sess, uint8_t flag, uint32_t timeout
     ctx->connect_req.data = ctx;
     ctx->shutdown_req.data = ctx;
 
-    ctx->wbuf = (char *)rps_alloc(WRITE_BUF_SIZE);
-    if (ctx->wbuf == NULL) {
-        return RPS_ENOMEM;
-    }
-    
-    ctx->wbuf2 = (char *)rps_alloc(WRITE_BUF_SIZE);
-    if (ctx->wbuf2 == NULL) {
-        rps_free(ctx->wbuf);
-        ctx->wbuf = NULL;
-        return RPS_ENOMEM;
-    }
+    /* Write chunks be borrowed from server buffer pool on demand */
+    chunk_queue_init(&ctx->wq);
 
     ctx->req = NULL;
     ctx->do_next = NULL;
@@ -276,14 +530,19 @@ server_ctx_deinit(rps_ctx_t *ctx) {
     ctx->established = 0;
     ctx->c_count = 0;
 
+    chunk_unref(ctx->rchunk);
+    ctx->rchunk = NULL;
+    ctx->rbuf = NULL;
+    ctx->rsize = 0;
+
+    chunk_queue_deinit(&ctx->wq);
+
     ctx->handle.handle.data  = NULL;
     ctx->write_req.data = NULL;
     ctx->timer.data = NULL;
     ctx->connect_req.data = NULL;
     ctx->shutdown_req.data = NULL;
 
-    rps_free(ctx->wbuf);
-    rps_free(ctx->wbuf2);
 
     if (ctx->req != NULL) {
         rps_free(ctx->req);
@@ -308,6 +567,12 @@ server_ctx_dead(rps_ctx_t *ctx) {
 }
 
 
+/* The opposite context of session, ctx relay data to and from it */
+static rps_ctx_t *
+server_ctx_endpoint(rps_ctx_t *ctx) {
+    return ctx->flag == c_request ? ctx->sess->forward : ctx->sess->request;
+}
+
 static void 
 server_on_ctx_close(uv_handle_t* handle) {
     //Set flag be closed and 
@@ -324,13 +589,13 @@ server_on_ctx_close(uv_handle_t* handle) {
     
     switch (ctx->flag) {
         case c_request:
-            log_debug("Request from %s:%d be closed", 
-                    ctx->peername, rps_unresolve_port(&ctx->peer));
+            log_debug("Request from %s:%d be closed, %llu bytes relayed", 
+                    ctx->peername, rps_unresolve_port(&ctx->peer), (unsigned long long)ctx->relayed);
             break;
         case c_forward:
-            if (ctx->sess->upstream != NULL) {
-                log_debug("Forward to %s:%d be closed.", 
-                    ctx->peername, rps_unresolve_port(&ctx->peer));    
+            if (!ctx->warm && !ctx->hedge && !ctx->probe && ctx->sess->upstream != NULL) {
+                log_debug("Forward to %s:%d be closed, %llu bytes relayed", 
+                    ctx->peername, rps_unresolve_port(&ctx->peer), (unsigned long long)ctx->relayed);
             }
             break;
         default:
@@ -344,6 +609,76 @@ server_on_ctx_close(uv_handle_t* handle) {
 
 
 
+#ifdef SPLICE_F_MOVE
+/*
+ * Splice relay, move the bytes of established tunnel socket -> pipe -> socket
+ * in kernel, both contexts stop libuv reading and be polled on dup'd fds.
+ * Direction 0 relay request to forward, direction 1 relay forward to request.
+ */
+struct server_splice {
+    rps_sess_t      *sess;
+    uv_poll_t       poll[2];
+    int             fd[2];
+    int             pipe[2][2];
+    size_t          pending[2]; /* bytes buffered in pipe of the direction */
+    uint8_t         eof[2];
+    uint8_t         c_count;
+};
+
+static void
+server_on_splice_close(uv_handle_t *handle) {
+    struct server_splice *sp;
+
+    sp = handle->data;
+
+    sp->c_count += 1;
+    if (sp->c_count < 2) {
+        return;
+    }
+
+    /*
+     * Close the dup'd fds only after both polls closed, stale events of 
+     * current loop iteration never hit a reused fd number.
+     */
+    close(sp->fd[0]);
+    close(sp->fd[1]);
+
+    rps_free(sp);
+}
+#endif
+
+/* Detach the splice relay from session, pipe buffered data be discarded */
+static void
+server_splice_stop(rps_sess_t *sess) {
+#ifdef SPLICE_F_MOVE
+    struct server_splice *sp;
+    struct epoll_event ev;
+    int i;
+
+    sp = sess->splice;
+    if (sp == NULL) {
+        return;
+    }
+
+    sess->splice = NULL;
+    sp->sess = NULL;
+
+    for (i = 0; i < 2; i++) {
+        uv_close((uv_handle_t *)&sp->poll[i], server_on_splice_close);
+        /* 
+         * The socket is still referenced by the libuv handle, closing
+         * the dup'd fd doesn't remove it from epoll set. 
+         */
+        epoll_ctl(uv_backend_fd(&sess->server->loop), EPOLL_CTL_DEL, sp->fd[i], &ev);
+        close(sp->pipe[i][0]);
+        close(sp->pipe[i][1]);
+    }
+#else
+    UNUSED(sess);
+#endif
+}
+
+
 static void
 server_ctx_close(rps_ctx_t *ctx) {
 
@@ -351,6 +686,12 @@ server_ctx_close(rps_ctx_t *ctx) {
         return;
     }
 
+    server_splice_stop(ctx->sess);
+
+#ifdef RPS_HAVE_IO_URING
+    server_uring_detach(ctx);
+#endif
+
     uv_timer_stop(&ctx->timer);
     uv_close((uv_handle_t *)&ctx->timer, (uv_close_cb)server_on_ctx_close);
 
@@ -375,6 +716,7 @@ server_ctx_close(rps_ctx_t *ctx) {
 
 static void
 server_close(rps_sess_t *sess) {
+    server_hedge_cancel(sess);
     server_ctx_close(sess->request);
     server_ctx_close(sess->forward);
     server_sess_mark_fail(sess);
@@ -382,17 +724,46 @@ server_close(rps_sess_t *sess) {
 
 static void
 server_on_ctx_shutdown(uv_shutdown_t* req, int err) {
+    rps_ctx_t *ctx, *endpoint;
+    rps_sess_t *sess;
     
     if (err == UV_ECANCELED) {
         return;  /* Handle has been closed. */
     }
 
+    ctx = req->data;
+
     if (err) {
         UV_SHOW_ERROR(err, "on shutdown done");
+        if (!server_ctx_dead(ctx) && (ctx->state & c_established)) {
+            ctx->state = c_kill;
+            server_do_next(ctx);
+        }
+        return;
+    }
+
+    if (!(ctx->state & c_established)) {
+        server_ctx_close(ctx);
+        return;
+    }
+
+    /*
+     * Half-closed tunnel, the opposite direction keeps relaying. 
+     * Tear down the session only after both directions finished.
+     */
+    ctx->wclosed = 1;
+
+    sess = ctx->sess;
+    endpoint = server_ctx_endpoint(ctx);
+
+    if (!server_ctx_dead(endpoint) 
+            && !(ctx->reof && endpoint->reof && endpoint->wclosed)) {
         return;
     }
 
-    server_ctx_close((rps_ctx_t *)req->data);
+    server_ctx_close(ctx);
+    server_ctx_close(endpoint);
+    server_sess_mark_success(sess);
 }
 
 static void
@@ -403,6 +774,15 @@ server_ctx_shutdown(rps_ctx_t *ctx) {
     if (server_ctx_dead(ctx)) {
         return;
     }
+
+    /* Only the head of output queue has been handed to libuv, 
+     * shutdown once the whole queue drained. */
+    if (!chunk_queue_empty(&ctx->wq)) {
+        ctx->wshutdown = 1;
+        return;
+    }
+
+    ctx->wshutdown = 0;
     
     err = uv_shutdown(&ctx->shutdown_req, &ctx->handle.stream, server_on_ctx_shutdown);
     if (err) {
@@ -411,6 +791,33 @@ server_ctx_shutdown(rps_ctx_t *ctx) {
 }
 
 
+static void
+server_rbuf_release(rps_ctx_t *ctx) {
+    chunk_unref(ctx->rchunk);
+    ctx->rchunk = NULL;
+    ctx->rbuf = NULL;
+    ctx->rsize = 0;
+}
+
+/*
+ * Grow read buffer while reads keep filling it up, shrink it after 
+ * several mostly empty reads.
+ */
+static void
+server_rbuf_adapt(rps_ctx_t *ctx, size_t nread) {
+    if (nread == ctx->rsize && ctx->rwant < READ_BUF_MAX_SIZE) {
+        ctx->rwant <<= 1;
+        ctx->rshrink = 0;
+    } else if (nread <= ctx->rsize / 4 && ctx->rwant > READ_BUF_SIZE) {
+        if (++ctx->rshrink >= READ_BUF_SHRINK_READS) {
+            ctx->rwant >>= 1;
+            ctx->rshrink = 0;
+        }
+    } else {
+        ctx->rshrink = 0;
+    }
+}
+
 static uv_buf_t *
 server_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
     rps_ctx_t *ctx;
@@ -419,8 +826,21 @@ server_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
 
     ctx = handle->data;
 
+    if (ctx->rchunk == NULL || ctx->rchunk->size != ctx->rwant) {
+        server_rbuf_release(ctx);
+        ctx->rchunk = chunk_get(&ctx->sess->server->buffers, ctx->rwant);
+        if (ctx->rchunk == NULL) {
+            /* libuv report UV_ENOBUFS to read callback */
+            buf->base = NULL;
+            buf->len = 0;
+            return buf;
+        }
+        ctx->rbuf = ctx->rchunk->data;
+        ctx->rsize = chunk_capacity(ctx->rchunk);
+    }
+
     buf->base = ctx->rbuf;
-    buf->len = sizeof(ctx->rbuf);
+    buf->len = ctx->rsize;
 
     return buf;
 }
@@ -484,6 +904,10 @@ server_on_read_done(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
     ctx->rstat = c_done;
     ctx->nread = nread;
 
+    if (nread > 0) {
+        server_rbuf_adapt(ctx, (size_t)nread);
+    }
+
     if (nread <0 ) {
         
         if (ctx->state & c_established) {
@@ -506,6 +930,13 @@ server_on_read_done(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
 
     /* nread equal 0 is equivalent to EAGAIN or EWOULDBLOCK */
     if (nread == 0) {
+        /* 
+         * Socket be drained, hand the buffer back to pool while idle. 
+         * Handshake data must survive until the tunnel be established.
+         */
+        if (ctx->state & c_established) {
+            server_rbuf_release(ctx);
+        }
         return;
     }
 
@@ -526,6 +957,12 @@ static rps_status_t
 server_read_start(rps_ctx_t *ctx) {
     int err;
 
+#ifdef RPS_HAVE_IO_URING
+    if (ctx->uring) {
+        return server_uring_recv(ctx);
+    }
+#endif
+
     err = uv_read_start(&ctx->handle.stream, 
             (uv_alloc_cb)server_alloc, (uv_read_cb)server_on_read_done);
     if (err < 0) {
@@ -537,382 +974,2353 @@ server_read_start(rps_ctx_t *ctx) {
     return RPS_OK;
 }
 
-/*
+/* Stop reading the source until the write queue of ctx be drained */
 static void
-server_read_stop(rps_ctx_t *ctx) {
-    uv_read_stop(&ctx->handle.stream);
-    ctx->rstat = c_stop;
-}
-*/
+server_read_pause(rps_ctx_t *ctx) {
+    rps_ctx_t *src;
 
-static void
-server_on_write_done(uv_write_t *req, int err) {
-    rps_ctx_t *ctx;
+    src = server_ctx_endpoint(ctx);
 
-    if (err == UV_ECANCELED) {
-        return;  /* Handle has been closed. */
+    if (server_ctx_dead(src) || src->paused || src->reof 
+            || !(src->state & c_established)) {
+        return;
     }
 
-    ctx = req->data;
+    uv_read_stop(&src->handle.stream);
+    src->rstat = c_stop;
+    src->paused = 1;
+}
 
-    if (server_ctx_dead(ctx)) {
+static void
+server_read_resume(rps_ctx_t *ctx) {
+    rps_ctx_t *src;
+
+    src = server_ctx_endpoint(ctx);
+
+    if (server_ctx_dead(src) || !src->paused) {
         return;
     }
 
-    ctx->wstat = c_done;
+    src->paused = 0;
 
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "on write to %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
-        ctx->state = c_kill;
-        server_do_next(ctx);
+    if (src->reof) {
         return;
     }
 
-    if (ctx->nwrite2 > 0) {
-        server_write(ctx, ctx->wbuf2, ctx->nwrite2);
-        ctx->nwrite2 = 0;
+    if (server_read_start(src) != RPS_OK) {
+        src->state = c_kill;
+        server_do_next(src);
     }
-
 }
 
-rps_status_t
-server_write(rps_ctx_t *ctx, const void *data, size_t len) {
-    int err;
-    uv_buf_t buf;
-    size_t slot;
+#ifdef SPLICE_F_MOVE
+static void server_on_splice_poll(uv_poll_t *handle, int status, int events);
+
+/* Move bytes of direction d, return -1 on error, otherwise 0 */
+static int
+server_splice_relay(struct server_splice *sp, int d) {
+    rps_ctx_t *src, *dst;
+    ssize_t n;
+    int i;
+
+    src = d == 0 ? sp->sess->request : sp->sess->forward;
+    dst = d == 0 ? sp->sess->forward : sp->sess->request;
+
+    for (i = 0; i < SERVER_SPLICE_BATCH; i++) {
+        if (sp->pending[d] > 0) {
+            n = splice(sp->pipe[d][0], NULL, sp->fd[1 - d], NULL, sp->pending[d], 
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    return 0;
+                }
+                log_debug("splice to %s failed: %s", dst->peername, strerror(errno));
+                return -1;
+            }
+            sp->pending[d] -= n;
+            src->relayed += n;
+            if (d == 1 && sp->sess->first_byte == 0) {
+                sp->sess->first_byte = uv_now(&sp->sess->server->loop);
+            }
+            server_timer_reset(dst);
+            continue;
+        }
 
-    ASSERT(len > 0);
+        /* Stop filling pipes once either side hit EOF, drain and hand over */
+        if (sp->eof[0] || sp->eof[1]) {
+            return 0;
+        }
 
-    if (ctx->wstat == c_busy) {
-        slot = WRITE_BUF_SIZE - ctx->nwrite2;
-        if (slot == 0) {
-            log_debug("write buffer to %s has been full, drop %d bytes.", ctx->peername, len);
-            return RPS_OK; 
+        /* Only read into an empty pipe, EAGAIN then always means socket drained */
+        n = splice(sp->fd[d], NULL, sp->pipe[d][1], NULL, SERVER_SPLICE_PIPE_SIZE, 
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            log_debug("splice from %s failed: %s", src->peername, strerror(errno));
+            return -1;
         }
 
-        len = MIN(slot, len);
+        if (n == 0) {
+            sp->eof[d] = 1;
+            return 0;
+        }
 
-        memcpy(&ctx->wbuf2[ctx->nwrite2], data, len);
-        ctx->nwrite2 += len;
-        return RPS_OK;
+        sp->pending[d] += n;
+        server_timer_reset(src);
     }
 
+    return 0;
+}
 
-    memcpy(ctx->wbuf, data, len);
-    ctx->nwrite = len;
-
-    buf.base = (char *)ctx->wbuf;
-    buf.len = len;
+static void
+server_splice_pump(struct server_splice *sp) {
+    rps_sess_t *sess;
+    rps_ctx_t *ctx;
+    int d, i, events, err;
 
-    
-    err = uv_write(&ctx->write_req, 
-             &ctx->handle.stream, 
-             &buf, 
-             1, 
-             server_on_write_done);
+    sess = sp->sess;
 
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "write to %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
-        return RPS_ERROR;
+    for (d = 0; d < 2; d++) {
+        if (server_splice_relay(sp, d) != 0) {
+            ctx = d == 0 ? sess->request : sess->forward;
+            ctx->state = c_kill;
+            server_do_next(ctx);
+            return;
+        }
     }
-    
 
-#if RPS_DEBUG_OPEN
-    if (ctx->proto == SOCKS5 && ctx->state < c_established) {
-        log_verb("write %zd bytes", len);
-        log_hex(LOG_VERBOSE, (char *)data, len);
+    /*
+     * Hand over to the buffered relay path once both pipes be drained, 
+     * the direction still open goes on by libuv reading.
+     */
+    if ((sp->eof[0] || sp->eof[1]) && sp->pending[0] == 0 && sp->pending[1] == 0) {
+        server_splice_stop(sess);
+
+        for (d = 0; d < 2; d++) {
+            ctx = d == 0 ? sess->request : sess->forward;
+            if (!sp->eof[d] && server_read_start(ctx) != RPS_OK) {
+                ctx->state = c_kill;
+                server_do_next(ctx);
+                return;
+            }
+        }
+
+        for (d = 0; d < 2; d++) {
+            ctx = d == 0 ? sess->request : sess->forward;
+            if (sp->eof[d] && !server_ctx_dead(ctx)) {
+                ctx->nread = UV_EOF;
+                server_do_next(ctx);
+            }
+        }
+        return;
     }
-#endif
 
-    ctx->wstat = c_busy;
+    for (i = 0; i < 2; i++) {
+        events = 0;
+        if (sp->pending[i] == 0 && !sp->eof[0] && !sp->eof[1]) {
+            events |= UV_READABLE;
+        }
+        if (sp->pending[1 - i] > 0) {
+            events |= UV_WRITABLE;
+        }
 
-    server_timer_reset(ctx);
-    
-    return RPS_OK;
+        if (events == 0) {
+            uv_poll_stop(&sp->poll[i]);
+            continue;
+        }
+
+        err = uv_poll_start(&sp->poll[i], events, server_on_splice_poll);
+        if (err) {
+            UV_SHOW_ERROR(err, "splice poll start");
+            ctx = i == 0 ? sess->request : sess->forward;
+            ctx->state = c_kill;
+            server_do_next(ctx);
+            return;
+        }
+    }
 }
 
 static void
-server_on_connect_done(uv_connect_t *req, int err) {
+server_on_splice_poll(uv_poll_t *handle, int status, int events) {
+    struct server_splice *sp;
     rps_ctx_t *ctx;
 
-    if (err == UV_ECANCELED) {
-        return;  /* Handle has been closed. */
-    }
+    UNUSED(events);
 
-    ctx = req->data;
+    sp = handle->data;
 
-    if (server_ctx_dead(ctx)) {
+    if (sp->sess == NULL) {
         return;
     }
 
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "on connect with %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
-        ctx->connected = 0;
-    } else {
-        ctx->connected = 1;
-    }
-
-    //ctx->connecting = 0;
-
-    /* request maybe killed before forward connected. */
-    if (ctx->flag == c_forward && server_ctx_dead(ctx->sess->request)) {
+    if (status < 0) {
+        ctx = handle == &sp->poll[0] ? sp->sess->request : sp->sess->forward;
+        UV_SHOW_ERROR(status, "splice poll");
         ctx->state = c_kill;
+        server_do_next(ctx);
+        return;
     }
 
-    server_do_next(ctx);
+    server_splice_pump(sp);
 }
 
+static bool
+server_splice_ready(rps_ctx_t *ctx) {
+    return !server_ctx_dead(ctx) && (ctx->state & c_established) && !ctx->reof
+        && ctx->stream == c_tunnel && ctx->wstat != c_busy && chunk_queue_empty(&ctx->wq);
+}
 
-static rps_status_t
-server_connect(rps_ctx_t *ctx) {
-    int err;
+/* 
+ * Switch the established tunnel to splice relay while both contexts have
+ * nothing pending in user space, the unread bytes stay in socket buffers.
+ */
+static void
+server_splice_start(rps_sess_t *sess) {
+    struct server_splice *sp;
+    rps_ctx_t *ctx[2];
+    uv_os_fd_t fd;
+    int i, err;
+
+    if (!sess->server->splice || sess->splice != NULL) {
+        return;
+    }
+
+    ctx[0] = sess->request;
+    ctx[1] = sess->forward;
+
+    if (!server_splice_ready(ctx[0]) || !server_splice_ready(ctx[1])) {
+        return;
+    }
+
+    sp = (struct server_splice *)rps_alloc(sizeof(*sp));
+    if (sp == NULL) {
+        return;
+    }
+
+    sp->sess = sess;
+    sp->c_count = 0;
+
+    for (i = 0; i < 2; i++) {
+        sp->pending[i] = 0;
+        sp->eof[i] = 0;
+        sp->fd[i] = -1;
+        sp->pipe[i][0] = -1;
+        sp->pipe[i][1] = -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (pipe2(sp->pipe[i], O_NONBLOCK | O_CLOEXEC) < 0) {
+            log_error("create splice pipe failed: %s", strerror(errno));
+            goto error;
+        }
+        /* Best effort, a smaller pipe only costs more splice calls */
+        fcntl(sp->pipe[i][1], F_SETPIPE_SZ, SERVER_SPLICE_PIPE_SIZE);
+
+        if (uv_fileno((uv_handle_t *)&ctx[i]->handle.handle, &fd) != 0) {
+            goto error;
+        }
+
+        /* libuv allows only one watcher per fd, poll on a duplicate */
+        sp->fd[i] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (sp->fd[i] < 0) {
+            log_error("dup %s socket failed: %s", ctx[i]->peername, strerror(errno));
+            goto error;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        err = uv_poll_init(&sess->server->loop, &sp->poll[i], sp->fd[i]);
+        if (err) {
+            UV_SHOW_ERROR(err, "splice poll init");
+            if (i == 0) {
+                goto error;
+            }
+            /* Release the fds and memory in close callback of the first poll */
+            sp->sess = NULL;
+            sp->c_count = 1;
+            for (i = 0; i < 2; i++) {
+                close(sp->pipe[i][0]);
+                close(sp->pipe[i][1]);
+            }
+            uv_close((uv_handle_t *)&sp->poll[0], server_on_splice_close);
+            return;
+        }
+        sp->poll[i].data = sp;
+    }
+
+    for (i = 0; i < 2; i++) {
+        uv_read_stop(&ctx[i]->handle.stream);
+        ctx[i]->rstat = c_stop;
+        ctx[i]->paused = 0;
+        server_rbuf_release(ctx[i]);
+    }
+
+    sess->splice = sp;
+
+    log_debug("Splice tunnel %s:%d <-> %s:%d", 
+            ctx[0]->peername, rps_unresolve_port(&ctx[0]->peer),
+            ctx[1]->peername, rps_unresolve_port(&ctx[1]->peer));
+
+    server_splice_pump(sp);
+    return;
+
+error:
+    for (i = 0; i < 2; i++) {
+        if (sp->fd[i] >= 0) {
+            close(sp->fd[i]);
+        }
+        if (sp->pipe[i][0] >= 0) {
+            close(sp->pipe[i][0]);
+            close(sp->pipe[i][1]);
+        }
+    }
+    rps_free(sp);
+}
+#endif
+
+#ifdef RPS_HAVE_IO_URING
+/*
+ * io_uring relay, contexts of established tunnel stop libuv reading, their
+ * recv and send requests be queued to the loop's ring and submitted in one
+ * io_uring_enter by a prepare handle right before the loop block. The ring
+ * fd is polled by libuv, completions be dispatched as read and write done.
+ */
+static void server_write_done(rps_ctx_t *ctx, size_t nwritten);
+
+static struct io_uring_sqe *
+server_uring_sqe(struct server *s) {
+    struct io_uring_sqe *sqe;
+    int err;
+
+    sqe = uring_get_sqe(&s->ring);
+    if (sqe != NULL) {
+        return sqe;
+    }
+
+    /* Submission queue full, submit ahead of the prepare handle */
+    err = uring_submit(&s->ring);
+    if (err < 0) {
+        log_error("io_uring submit failed: %s", strerror(-err));
+        return NULL;
+    }
+
+    return uring_get_sqe(&s->ring);
+}
+
+static void
+server_uring_op_put(struct server *s, struct server_uring_op *op) {
+    unsigned int i;
+
+    for (i = 0; i < op->n; i++) {
+        chunk_unref(op->chunks[i]);
+    }
+
+    object_put(&s->uring_ops, op);
+}
+
+static struct server_uring_op *
+server_uring_op_get(rps_ctx_t *ctx, uint8_t type, struct io_uring_sqe **sqe) {
+    struct server *s;
+    struct server_uring_op *op;
+
+    s = ctx->sess->server;
+
+    op = object_get(&s->uring_ops);
+    if (op == NULL) {
+        return NULL;
+    }
+
+    op->ctx = ctx;
+    op->type = type;
+    op->n = 0;
+
+    *sqe = server_uring_sqe(s);
+    if (*sqe == NULL) {
+        server_uring_op_put(s, op);
+        return NULL;
+    }
+
+    (*sqe)->user_data = (uint64_t)(uintptr_t)op;
+
+    return op;
+}
+
+static rps_status_t
+server_uring_recv(rps_ctx_t *ctx) {
+    struct server_uring_op *op;
+    struct io_uring_sqe *sqe;
+    uv_os_fd_t fd;
+    uv_buf_t buf;
+
+    if (ctx->urecv != NULL) {
+        return RPS_OK;
+    }
+
+    if (uv_fileno(&ctx->handle.handle, &fd) != 0) {
+        return RPS_ERROR;
+    }
+
+    server_alloc(&ctx->handle.handle, 0, &buf);
+    if (buf.base == NULL) {
+        log_warn("no read buffer for %s, buffer memory cap reached", ctx->peername);
+        return RPS_ENOMEM;
+    }
+
+    op = server_uring_op_get(ctx, u_recv, &sqe);
+    if (op == NULL) {
+        return RPS_ERROR;
+    }
+
+    /* Kernel may still write into the chunk after context closed */
+    op->chunks[op->n++] = chunk_ref(ctx->rchunk);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf.base;
+    sqe->len = (uint32_t)buf.len;
+
+    ctx->urecv = op;
+    ctx->rstat = c_busy;
+
+    return RPS_OK;
+}
+
+static rps_status_t
+server_uring_send(rps_ctx_t *ctx) {
+    struct server_uring_op *op;
+    struct io_uring_sqe *sqe;
+    uv_os_fd_t fd;
+    unsigned int i;
+
+    if (uv_fileno(&ctx->handle.handle, &fd) != 0) {
+        return RPS_ERROR;
+    }
+
+    op = server_uring_op_get(ctx, u_send, &sqe);
+    if (op == NULL) {
+        return RPS_ERROR;
+    }
+
+    op->n = chunk_queue_peek(&ctx->wq, op->bufs, op->chunks, 
+            WRITE_UV_BUF_SIZE, &ctx->nwrite);
+    for (i = 0; i < op->n; i++) {
+        chunk_ref(op->chunks[i]);
+    }
+
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = (struct iovec *)op->bufs;
+    op->msg.msg_iovlen = op->n;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+
+    ctx->usend = op;
+
+    return RPS_OK;
+}
+
+static void
+server_uring_recv_done(rps_ctx_t *ctx, int res) {
+    ctx->urecv = NULL;
+    ctx->rstat = c_done;
+
+    if (res == -EAGAIN || res == -EINTR) {
+        goto rearm;
+    }
+
+    if (res > 0) {
+        ASSERT(ctx->rchunk != NULL);
+        ctx->nread = res;
+        server_rbuf_adapt(ctx, (size_t)res);
+        server_timer_reset(ctx);
+    } else {
+        /* libuv error codes are negated errno on unix */
+        ctx->nread = res == 0 ? UV_EOF : res;
+    }
+
+    server_do_next(ctx);
+
+    if (res <= 0) {
+        return;
+    }
+
+rearm:
+    if (server_ctx_dead(ctx) || !ctx->uring || ctx->paused) {
+        return;
+    }
+
+    if (server_uring_recv(ctx) != RPS_OK) {
+        ctx->state = c_kill;
+        server_do_next(ctx);
+    }
+}
+
+static void
+server_uring_send_done(rps_ctx_t *ctx, int res) {
+    ctx->usend = NULL;
+
+    if (res == -EAGAIN || res == -EINTR) {
+        res = 0;
+    }
+
+    if (res < 0) {
+        char why[MAX_INET_ADDRSTRLEN + 16];
+        snprintf(why, sizeof(why), "on write to %s", ctx->peername);
+        UV_SHOW_ERROR(res, why);
+        ctx->wstat = c_done;
+        ctx->state = c_kill;
+        server_do_next(ctx);
+        return;
+    }
+
+    /* A short send leave the rest in queue, the next flush pick it up */
+    server_write_done(ctx, (size_t)res);
+}
+
+static void
+server_uring_on_poll(uv_poll_t *handle, int status, int events) {
+    struct server *s;
+    struct server_uring_op *op;
+    struct io_uring_cqe *cqe;
+    rps_ctx_t *ctx;
+    uint8_t type;
+    int res;
+
+    UNUSED(events);
+
+    s = handle->data;
+
+    if (status < 0) {
+        UV_SHOW_ERROR(status, "io_uring poll");
+        return;
+    }
+
+    while ((cqe = uring_peek_cqe(&s->ring)) != NULL) {
+        op = (struct server_uring_op *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(&s->ring);
+
+        /* Completion of cancel request */
+        if (op == NULL) {
+            continue;
+        }
+
+        ctx = op->ctx;
+        type = op->type;
+
+        /* Context still holds its own references of the chunks */
+        server_uring_op_put(s, op);
+
+        if (ctx == NULL) {
+            continue;
+        }
+
+        if (type == u_recv) {
+            server_uring_recv_done(ctx, res);
+        } else {
+            server_uring_send_done(ctx, res);
+        }
+    }
+}
+
+static void
+server_uring_on_prepare(uv_prepare_t *handle) {
+    struct server *s;
+    int err;
+
+    s = handle->data;
+
+    if (uring_sq_pending(&s->ring) == 0) {
+        return;
+    }
+
+    err = uring_submit(&s->ring);
+    if (err < 0) {
+        log_error("io_uring submit failed: %s", strerror(-err));
+    }
+}
+
+/* Orphan the requests in flight and cancel them, socket be closed by libuv */
+static void
+server_uring_detach(rps_ctx_t *ctx) {
+    struct server_uring_op *ops[2];
+    struct io_uring_sqe *sqe;
+    uv_os_fd_t fd;
+    int i;
+
+    if (!ctx->uring) {
+        return;
+    }
+
+    ctx->uring = 0;
+
+    ops[0] = ctx->urecv;
+    ops[1] = ctx->usend;
+    ctx->urecv = NULL;
+    ctx->usend = NULL;
+
+    for (i = 0; i < 2; i++) {
+        if (ops[i] == NULL) {
+            continue;
+        }
+
+        ops[i]->ctx = NULL;
+
+        sqe = server_uring_sqe(ctx->sess->server);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)(uintptr_t)ops[i];
+            sqe->user_data = 0;
+            continue;
+        }
+
+        /* The ring holds the socket open, wake up the request by shutdown */
+        if (uv_fileno(&ctx->handle.handle, &fd) == 0) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+}
+
+/* Hand both contexts of established tunnel over to the ring */
+static void
+server_uring_start(rps_sess_t *sess) {
+    rps_ctx_t *ctx[2];
+    int i;
+
+    if (!sess->server->io_uring || sess->request->uring) {
+        return;
+    }
+
+    ctx[0] = sess->request;
+    ctx[1] = sess->forward;
+
+    for (i = 0; i < 2; i++) {
+        if (server_ctx_dead(ctx[i]) || !(ctx[i]->state & c_established) 
+                || ctx[i]->stream != c_tunnel) {
+            return;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        uv_read_stop(&ctx[i]->handle.stream);
+        ctx[i]->uring = 1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        /* Paused one be armed on resume */
+        if (ctx[i]->paused) {
+            continue;
+        }
+        if (server_uring_recv(ctx[i]) != RPS_OK) {
+            ctx[i]->state = c_kill;
+            server_do_next(ctx[i]);
+            return;
+        }
+    }
+
+    log_debug("io_uring tunnel %s:%d <-> %s:%d", 
+            ctx[0]->peername, rps_unresolve_port(&ctx[0]->peer),
+            ctx[1]->peername, rps_unresolve_port(&ctx[1]->peer));
+}
+
+static void
+server_uring_init(struct server *s) {
+    int err;
+
+    err = uring_init(&s->ring, SERVER_URING_ENTRIES);
+    if (err < 0) {
+        log_warn("%s proxy worker %d io_uring setup failed: %s, fall back to libuv relay", 
+                s->cfg->proto.data, s->worker + 1, strerror(-err));
+        s->io_uring = 0;
+        return;
+    }
+
+    err = uv_poll_init(&s->loop, &s->ring_poll, s->ring.fd);
+    if (err) {
+        UV_SHOW_ERROR(err, "io_uring poll init");
+        uring_deinit(&s->ring);
+        s->io_uring = 0;
+        return;
+    }
+
+    s->ring_poll.data = s;
+
+    err = uv_poll_start(&s->ring_poll, UV_READABLE, server_uring_on_poll);
+    if (err) {
+        UV_SHOW_ERROR(err, "io_uring poll start");
+        /* Never be watched, the ring fd can be closed at once */
+        uv_close((uv_handle_t *)&s->ring_poll, NULL);
+        uring_deinit(&s->ring);
+        s->io_uring = 0;
+        return;
+    }
+
+    uv_prepare_init(&s->loop, &s->ring_prepare);
+    s->ring_prepare.data = s;
+    uv_prepare_start(&s->ring_prepare, (uv_prepare_cb)server_uring_on_prepare);
+
+    log_info("%s proxy worker %d relay tunnels by io_uring", 
+            s->cfg->proto.data, s->worker + 1);
+}
+#endif
+
+static void server_on_write_done(uv_write_t *req, int err);
+
+/* Write out the head chunks of output queue unless a write in flight */
+static rps_status_t
+server_flush(rps_ctx_t *ctx) {
+    uv_buf_t bufs[WRITE_UV_BUF_SIZE];
+    unsigned int n;
+    int err;
+
+    if (ctx->wstat == c_busy || chunk_queue_empty(&ctx->wq)) {
+        return RPS_OK;
+    }
+
+#ifdef RPS_HAVE_IO_URING
+    if (ctx->uring) {
+        if (server_uring_send(ctx) != RPS_OK) {
+            return RPS_ERROR;
+        }
+        ctx->wstat = c_busy;
+        server_timer_reset(ctx);
+        return RPS_OK;
+    }
+#endif
+
+    n = chunk_queue_peek(&ctx->wq, bufs, NULL, WRITE_UV_BUF_SIZE, &ctx->nwrite);
+
+    err = uv_write(&ctx->write_req, 
+             &ctx->handle.stream, 
+             bufs, 
+             n, 
+             server_on_write_done);
+
+    if (err) {
+        char why[256];
+        snprintf(why, 256, "write to %s", ctx->peername);
+        UV_SHOW_ERROR(err, why);
+        return RPS_ERROR;
+    }
+
+    ctx->wstat = c_busy;
+
+    server_timer_reset(ctx);
+    
+    return RPS_OK;
+}
+
+/* Data has been queued, apply backpressure to the source then flush */
+static rps_status_t
+server_write_queued(rps_ctx_t *ctx) {
+    if (ctx->wq.bytes >= WRITE_HIGH_WATERMARK) {
+        server_read_pause(ctx);
+    }
+
+    return server_flush(ctx);
+}
+
+/* nwritten bytes of the flushed head have been sent out */
+static void
+server_write_done(rps_ctx_t *ctx, size_t nwritten) {
+    rps_ctx_t *src;
+
+    ctx->wstat = c_done;
+
+    chunk_queue_consume(&ctx->wq, nwritten);
+    ctx->nwrite = 0;
+
+    if (server_flush(ctx) != RPS_OK) {
+        ctx->state = c_kill;
+        server_do_next(ctx);
+        return;
+    }
+
+    if (ctx->wshutdown && chunk_queue_empty(&ctx->wq)) {
+        server_ctx_shutdown(ctx);
+    }
+
+    /* The peer is draining, keep the paused source from read timeout */
+    src = server_ctx_endpoint(ctx);
+    if (!server_ctx_dead(src) && src->paused) {
+        server_timer_reset(src);
+        if (ctx->wq.bytes <= WRITE_LOW_WATERMARK) {
+            server_read_resume(ctx);
+        }
+    }
+
+#ifdef SPLICE_F_MOVE
+    server_splice_start(ctx->sess);
+#endif
+
+}
+
+static void
+server_on_write_done(uv_write_t *req, int err) {
+    rps_ctx_t *ctx;
+
+    if (err == UV_ECANCELED) {
+        return;  /* Handle has been closed. */
+    }
+
+    ctx = req->data;
+
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    if (err) {
+        char why[256];
+        snprintf(why, 256, "on write to %s", ctx->peername);
+        UV_SHOW_ERROR(err, why);
+        ctx->wstat = c_done;
+        ctx->state = c_kill;
+        server_do_next(ctx);
+        return;
+    }
+
+    server_write_done(ctx, ctx->nwrite);
+}
+
+/* Try to write without queuing, return bytes written or a negative error */
+static ssize_t
+server_try_write(rps_ctx_t *ctx, const uv_buf_t *bufs, unsigned int nbufs) {
+    int n;
+
+    /* io_uring context leave every write to the ring */
+    if (ctx->uring || ctx->wstat == c_busy || !chunk_queue_empty(&ctx->wq)) {
+        return 0;
+    }
+
+    n = uv_try_write(&ctx->handle.stream, bufs, nbufs);
+    if (n == UV_EAGAIN) {
+        return 0;
+    }
+
+    if (n < 0) {
+        char why[MAX_INET_ADDRSTRLEN + 16];
+        snprintf(why, sizeof(why), "write to %s", ctx->peername);
+        UV_SHOW_ERROR(n, why);
+        return n;
+    }
+
+    server_timer_reset(ctx);
+
+    return n;
+}
+
+rps_status_t
+server_writev(rps_ctx_t *ctx, const uv_buf_t *bufs, unsigned int nbufs) {
+    struct buffer_pool *pool;
+    size_t total, skip;
+    ssize_t n;
+    unsigned int i;
+
+    pool = &ctx->sess->server->buffers;
+
+    total = 0;
+    for (i = 0; i < nbufs; i++) {
+        total += bufs[i].len;
+    }
+
+    ASSERT(total > 0);
+
+#if RPS_DEBUG_OPEN
+    if (ctx->proto == SOCKS5 && ctx->state < c_established) {
+        log_verb("write %zu bytes", total);
+        for (i = 0; i < nbufs; i++) {
+            log_hex(LOG_VERBOSE, bufs[i].base, bufs[i].len);
+        }
+    }
+#endif
+
+    /* Nothing queued, try to write straight from caller's buffers */
+    n = server_try_write(ctx, bufs, nbufs);
+    if (n < 0) {
+        return RPS_ERROR;
+    }
+
+    skip = (size_t)n;
+    if (skip == total) {
+        return RPS_OK;
+    }
+
+    /* Queue the unsent tail */
+    for (i = 0; i < nbufs; i++) {
+        if (skip >= bufs[i].len) {
+            skip -= bufs[i].len;
+            continue;
+        }
+        if (chunk_queue_append(&ctx->wq, pool, bufs[i].base + skip, 
+                    bufs[i].len - skip) != RPS_OK) {
+            log_warn("no write buffer for %s, buffer memory cap reached", ctx->peername);
+            return RPS_ENOMEM;
+        }
+        skip = 0;
+    }
+
+    return server_write_queued(ctx);
+}
+
+rps_status_t
+server_write(rps_ctx_t *ctx, const void *data, size_t len) {
+    uv_buf_t buf;
+
+    ASSERT(len > 0);
+
+    buf = uv_buf_init((char *)data, len);
+
+    return server_writev(ctx, &buf, 1);
+}
+
+/* 
+ * Relay the data just read by src to ctx. The unsent part of a large read
+ * be queued by handing over the read chunk itself, small one be copied 
+ * into the queue tail so that chunks don't pile up.
+ */
+static rps_status_t
+server_relay(rps_ctx_t *ctx, rps_ctx_t *src, size_t len) {
+    struct chunk *c;
+    uv_buf_t buf;
+    ssize_t n;
+
+    c = src->rchunk;
+
+    ASSERT(c != NULL && src->rbuf == c->data);
+    ASSERT(len <= chunk_capacity(c));
+
+    buf = uv_buf_init(c->data, len);
+
+    n = server_try_write(ctx, &buf, 1);
+    if (n < 0) {
+        return RPS_ERROR;
+    }
+
+    if ((size_t)n == len) {
+        return RPS_OK;
+    }
+
+    if (len - n <= WRITE_COALESCE_SIZE) {
+        if (chunk_queue_append(&ctx->wq, &ctx->sess->server->buffers, 
+                    &c->data[n], len - n) != RPS_OK) {
+            log_warn("no write buffer for %s, buffer memory cap reached", ctx->peername);
+            return RPS_ENOMEM;
+        }
+    } else {
+        c->start = n;
+        c->end = len;
+        chunk_queue_push(&ctx->wq, c);
+        /* src read into a new chunk next time */
+        server_rbuf_release(src);
+    }
+
+    return server_write_queued(ctx);
+}
+
+static void
+server_on_connect_done(uv_connect_t *req, int err) {
+    rps_ctx_t *ctx;
+
+    if (err == UV_ECANCELED) {
+        return;  /* Handle has been closed. */
+    }
+
+    ctx = req->data;
+
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    if (err) {
+        char why[256];
+        snprintf(why, 256, "on connect with %s", ctx->peername);
+        UV_SHOW_ERROR(err, why);
+        ctx->connected = 0;
+    } else {
+        ctx->connected = 1;
+    }
+
+    //ctx->connecting = 0;
+
+    /* request maybe killed before forward connected. */
+    if (ctx->flag == c_forward && !ctx->warm && server_ctx_dead(ctx->sess->request)) {
+        ctx->state = c_kill;
+    }
+
+    server_do_next(ctx);
+}
+
+
+static rps_status_t
+server_connect(rps_ctx_t *ctx) {
+    int err;
+
+    ASSERT(!ctx->connected);
+    ASSERT(!ctx->connecting);
+
+    //uv_tcp_init must be called before call uv_tcp_connect each time.
+    uv_tcp_init(&ctx->sess->server->loop, &ctx->handle.tcp);
+
+    err = uv_tcp_connect(&ctx->connect_req, 
+            &ctx->handle.tcp, 
+            (const struct sockaddr *)&ctx->peer.addr,
+            server_on_connect_done);
+
+    if (err) {
+        char why[256];
+        snprintf(why, 256, "tcp connect %s", ctx->peername);
+        UV_SHOW_ERROR(err, why);
+        return RPS_ERROR;
+    }
+
+    ctx->connecting = 1;
+
+    server_timer_reset(ctx);
+
+    return RPS_OK;
+}
+
+
+/*
+ *         request            forward
+ * Client  ------->    RPS  ----------> Upstream ----> Remote
+ *         context            context
+ *  |                                      |
+ *  |  ---          session          ---   |
+ */
+
+static void
+server_accept(struct server *s, uv_stream_t *us) {
+    rps_sess_t *sess;
+    rps_ctx_t *request; /* client -> rps */
+    int len;
+    int err;
+    rps_status_t status;
+
+    if (s->conn_count >= MAX_CONNECTIONS) {
+        log_warn("max connections (%d) reached, rejecting new connection.", MAX_CONNECTIONS);
+        uv_tcp_t tmp;
+        uv_tcp_init(&s->loop, &tmp);
+        uv_accept(us, (uv_stream_t *)&tmp);
+        uv_close((uv_handle_t *)&tmp, NULL);
+        return;
+    }
+
+    sess = (struct session*)object_get(&s->sessions);
+    if (sess == NULL) {
+        return;
+    }
+    server_sess_init(sess, s);
+    rps_atomic_store(&s->conn_count, s->conn_count + 1);
+
+    request = (struct context *)object_get(&s->contexts);
+    if (request == NULL) {
+        rps_atomic_store(&s->conn_count, s->conn_count - 1);
+        object_put(&s->sessions, sess);
+        return;
+    }
+    sess->request = request;
+    status = server_ctx_init(request, sess, c_request, s->rtimeout);
+    if (status != RPS_OK) {
+        rps_atomic_store(&s->conn_count, s->conn_count - 1);
+        object_put(&s->contexts, request);
+        object_put(&s->sessions, sess);
+        return;
+    }
+
+    server_ctx_set_proto(request, s->proto);
+    
+    uv_tcp_init(&s->loop, &request->handle.tcp);
+    uv_timer_init(&s->loop, &request->timer);
+
+    err = uv_accept(us, &request->handle.stream);
+    if (err) {
+        UV_SHOW_ERROR(err, "accept");
+        goto error;
+    }
+
+    request->connecting = 1;
+    request->connected = 1;
+
+    #ifdef REQUEST_TCP_KEEPALIVE
+    err = uv_tcp_keepalive(&request->handle, 1, TCP_KEEPALIVE_DELAY);
+    if (err) {
+        UV_SHOW_ERROR(err, "set tcp keepalive");
+        goto error;
+    }
+    #endif
+
+    
+    /*
+     * Get client address info.
+     */
+    len = (int)s->listen.addrlen;
+    err = uv_tcp_getpeername(&request->handle.tcp, 
+            (struct sockaddr *)&request->peer.addr, &len);
+    if (err) {
+        UV_SHOW_ERROR(err, "getpeername");
+        goto error;
+    }
+    request->peer.family = s->listen.family;
+    request->peer.addrlen = len;
+    
+    err = rps_unresolve_addr(&request->peer, request->peername);
+    if (err < 0) {
+        log_error("unresolve peername failer.");
+        goto error;
+    }
+
+    log_debug("Accept request from %s:%d", request->peername, rps_unresolve_port(&request->peer));
+
+    request->state = c_handshake_req;
+
+    /*
+     * Beigin receive data
+     */
+    status = server_read_start(request);
+    if (status != RPS_OK) {
+        goto error;
+    }
+
+    return;
+
+error:
+    server_close(request->sess);
+    return;
+}
+
+static void
+server_on_request_connect(uv_stream_t *us, int err) {
+    if (err) {
+        UV_SHOW_ERROR(err, "on new connect");
+        return;
+    }
+
+    server_accept((struct server *)us->data, us);
+}
+
+struct server_dispatch_req {
+    uv_write_t      req;
+    uv_tcp_t        tcp;
+    struct server   *worker;    /* the target, its dispatched is undone on failure */
+};
+
+static void
+server_on_dispatch_close(uv_handle_t *handle) {
+    rps_free(handle->data);
+}
+
+static void
+server_on_dispatch_done(uv_write_t *req, int err) {
+    struct server_dispatch_req *dr;
+    struct server *w;
+
+    dr = req->data;
+
+    /* Never be accepted by the worker, don't count it as in flight */
+    if (err) {
+        UV_SHOW_ERROR(err, "dispatch connection");
+        w = dr->worker;
+        rps_atomic_store(&w->dispatched, w->dispatched - 1);
+    }
+
+    /* The socket has been duplicated to worker, close the acceptor's copy */
+    uv_close((uv_handle_t *)&dr->tcp, server_on_dispatch_close);
+}
+
+/* Select the worker which has the fewest live and in-flight sessions */
+static struct server *
+server_dispatch_select(struct server *s) {
+    struct server *w, *selected;
+    uint32_t load, min;
+    uint16_t i;
+
+    selected = NULL;
+    min = UINT32_MAX;
+
+    for (i = 0; i < s->nworkers; i++) {
+        w = &s->workers[i];
+        load = rps_atomic_load(&w->conn_count) + 
+            (w->dispatched - rps_atomic_load(&w->accepted));
+        if (selected == NULL || load < min) {
+            selected = w;
+            min = load;
+        }
+    }
+
+    return selected;
+}
+
+static void
+server_on_dispatch_connect(uv_stream_t *us, int err) {
+    struct server *s, *w;
+    struct server_dispatch_req *dr;
+    uv_buf_t buf;
+
+    if (err) {
+        UV_SHOW_ERROR(err, "on new connect");
+        return;
+    }
+
+    s = (struct server *)us->data;
+
+    dr = (struct server_dispatch_req *)rps_alloc(sizeof(*dr));
+    if (dr == NULL) {
+        return;
+    }
+    dr->req.data = dr;
+    dr->tcp.data = dr;
+
+    uv_tcp_init(&s->loop, &dr->tcp);
+
+    err = uv_accept(us, (uv_stream_t *)&dr->tcp);
+    if (err) {
+        UV_SHOW_ERROR(err, "accept");
+        uv_close((uv_handle_t *)&dr->tcp, server_on_dispatch_close);
+        return;
+    }
+
+    w = server_dispatch_select(s);
+    dr->worker = w;
+
+    /* uv_write2 need at least 1 byte payload to carry the socket */
+    buf = uv_buf_init("d", 1);
+
+    err = uv_write2(&dr->req, (uv_stream_t *)&w->dispatcher, &buf, 1, 
+            (uv_stream_t *)&dr->tcp, server_on_dispatch_done);
+    if (err) {
+        UV_SHOW_ERROR(err, "dispatch connection");
+        uv_close((uv_handle_t *)&dr->tcp, server_on_dispatch_close);
+        return;
+    }
+
+    rps_atomic_store(&w->dispatched, w->dispatched + 1);
+}
+
+static void
+server_dispatch_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct server *s;
+
+    UNUSED(suggested_size);
+
+    s = handle->data;
+
+    buf->base = s->ipcbuf;
+    buf->len = sizeof(s->ipcbuf);
+}
+
+static void
+server_on_dispatch_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct server *s;
+    uv_pipe_t *ipc;
+
+    UNUSED(buf);
+
+    s = stream->data;
+    ipc = (uv_pipe_t *)stream;
+
+    if (nread < 0) {
+        UV_SHOW_ERROR(nread, "read dispatch channel");
+        return;
+    }
+
+    while (uv_pipe_pending_count(ipc) > 0) {
+        ASSERT(uv_pipe_pending_type(ipc) == UV_TCP);
+        rps_atomic_store(&s->accepted, s->accepted + 1);
+        server_accept(s, stream);
+    }
+}
+
+static void
+server_switch(rps_sess_t *sess) {
+    struct server *s;
+    rps_ctx_t *request;  /* client -> rps */
+    rps_ctx_t *forward; /* rps -> upstream */
+
+    //ASSERT(sess->forward == NULL);
+    // server_switch has been called, 
+    // however may double called due to request has invalid new data read.
+    if (sess->forward != NULL) {
+        return;
+    }
+
+    s = sess->server;
+    request = sess->request;
+    /* request stop read, wait for upstream establishment finished */
+    // server_read_stop(request);
+
+    forward = (struct context *)object_get(&s->contexts);
+    if (forward == NULL) {
+        request->state = c_kill;
+        server_do_next(request);
+        return;
+    }
+
+    if (server_ctx_init(forward, sess, c_forward,  s->ftimeout) != RPS_OK) {
+        object_put(&s->contexts, forward);
+        request->state = c_kill;
+        server_do_next(request);
+        return;
+    }
+    sess->forward = forward;
+    
+    uv_timer_init(&s->loop, &forward->timer);
+
+    /*
+     *  conext switch from reuqest to forward 
+     */
+    forward->state = c_conn;
+    server_do_next(forward); 
+}
+
+static void
+server_on_forward_close(uv_handle_t* handle) {
+    rps_ctx_t *forward;
+    rps_ctx_t *request;
+
+    forward = handle->data;
+    request = forward->sess->request;
+
+    forward->connecting = 0;
+    forward->connected = 0;
+    forward->established = 0;
+
+    /* Hedge won while reconnecting, the handle has been closed, the timer left */
+    if (forward->hedge) {
+        forward->state = c_conn;
+        server_ctx_close(forward);
+        return;
+    }
+
+    /* request context may have been free during server_forward_reconn called */
+    if (request == NULL) {
+        server_ctx_close(forward);
+        return;
+    }
+
+    server_sess_upstream_mark_fail(forward->sess);
+
+    forward->state = c_conn;
+    server_do_next(forward);
+    return;
+}
+
+static void
+server_forward_reconn(rps_ctx_t *forward) {
+    struct server *s;
+
+    s = forward->sess->server;
+
+    forward->reconn += 1;
+    
+    if (forward->reconn > s->upstreams->maxreconn) {
+        goto kill;
+    }
+
+    if (!forward->connecting) {
+        //reconnect directly
+        forward->state = c_conn;
+        server_do_next(forward);
+        return;
+    }
+
+    forward->state = c_closing;
+
+    uv_read_stop(&forward->handle.stream);
+    uv_timer_stop(&forward->timer);
+    uv_close(&forward->handle.handle, server_on_forward_close);
+    return;
+
+kill:
+    forward->state = c_kill;
+    server_do_next(forward);
+}
+
+/*
+ * Affinity key of consistent hash schedule. The attempt is appended when
+ * reconnect or retry, so a failed upstream won't be selected again.
+ */
+static size_t
+server_sess_hash_key(rps_sess_t *sess, char *key, size_t max_size) {
+    struct server *s;
+    rps_ctx_t *forward;
+    char name[MAX_HOSTNAME_LEN];
+    const char *k;
+    int len;
+
+    s = sess->server;
+    forward = sess->forward;
+
+    if (s->upstreams->schedule != up_hash) {
+        return 0;
+    }
+
+    switch (s->upstreams->hash_key) {
+    case up_hash_target:
+        if (rps_unresolve_addr(&sess->remote, name) != RPS_OK) {
+            return 0;
+        }
+        k = name;
+        break;
+    case up_hash_client:
+    default:
+        k = sess->request->peername;
+        break;
+    }
+
+    len = snprintf(key, max_size, "%s#%d", k, forward->reconn + forward->retry);
+    if (len < 0) {
+        return 0;
+    }
+
+    /* the first attempt hash the bare key */
+    if (forward->reconn + forward->retry == 0) {
+        len = strlen(k);
+    }
+
+    return MIN((size_t)len, max_size - 1);
+}
+
+/*
+ * Warm upstream connection, connected and for socks5 negotiated (and
+ * authenticated) ahead of sessions. It owns a private session until be
+ * claimed, the upstream is an identity copy since the pool may retire
+ * the original at any time.
+ */
+struct server_warm {
+    rps_sess_t          sess;
+    struct upstream     upstream;
+    rps_ctx_t           *ctx;
+    uint64_t            demand;     /* last time the upstream was selected */
+    uint8_t             parked:1;   /* ready to be claimed */
+    uint8_t             closing:1;
+    struct server_warm  *next;
+};
+
+static bool
+server_warm_match(struct upstream *a, struct upstream *b) {
+    if (a->proto != b->proto || a->server.family != b->server.family ||
+            a->server.addrlen != b->server.addrlen ||
+            a->uname.len != b->uname.len || a->passwd.len != b->passwd.len) {
+        return false;
+    }
+
+    return memcmp(&a->server.addr, &b->server.addr, a->server.addrlen) == 0 &&
+        (a->uname.len == 0 || memcmp(a->uname.data, b->uname.data, a->uname.len) == 0) &&
+        (a->passwd.len == 0 || memcmp(a->passwd.data, b->passwd.data, a->passwd.len) == 0);
+}
+
+static void
+server_warm_drop(rps_ctx_t *ctx) {
+    struct server_warm *w;
+
+    w = (struct server_warm *)ctx->sess;
+
+    if (w->parked) {
+        log_debug("Warm upstream %s:%d be dropped", ctx->peername,
+                rps_unresolve_port(&ctx->peer));
+    }
+
+    w->parked = 0;
+    w->closing = 1;
+    server_ctx_close(ctx);
+}
+
+static void
+server_warm_free(rps_ctx_t *ctx) {
+    struct server *s;
+    struct server_warm *w, **pw;
+
+    w = (struct server_warm *)ctx->sess;
+    s = w->sess.server;
+
+    for (pw = &s->warm; *pw != NULL; pw = &(*pw)->next) {
+        if (*pw == w) {
+            *pw = w->next;
+            break;
+        }
+    }
+
+    s->nwarm--;
+
+    object_put(&s->contexts, ctx);
+    string_deinit(&w->upstream.uname);
+    string_deinit(&w->upstream.passwd);
+    rps_free(w);
+}
+
+static rps_status_t server_warm_spawn(struct server *s, struct upstream *u, uint64_t demand);
+
+static void
+server_warm_on_expire(uv_timer_t *handle) {
+    rps_ctx_t *ctx;
+    struct server_warm *w;
+    struct server *s;
+
+    ctx = handle->data;
+
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    w = (struct server_warm *)ctx->sess;
+    s = w->sess.server;
+
+    /* Refresh the idle one while its upstream is still in demand */
+    if (uv_now(&s->loop) - w->demand < s->upstreams->warm_idle && s->nwarm < SERVER_WARM_MAX) {
+        server_warm_spawn(s, &w->upstream, w->demand);
+    }
+
+    server_warm_drop(ctx);
+}
+
+static void
+server_warm_park(rps_ctx_t *ctx) {
+    struct server_warm *w;
+    int err;
+
+    w = (struct server_warm *)ctx->sess;
+
+    /* Keep reading, upstream closing or junk drop it from stock */
+    server_rbuf_release(ctx);
+
+    err = uv_timer_start(&ctx->timer, (uv_timer_cb)server_warm_on_expire,
+            w->sess.server->upstreams->warm_idle, 0);
+    if (err) {
+        UV_SHOW_ERROR(err, "start warm timer");
+        server_warm_drop(ctx);
+        return;
+    }
+
+    w->parked = 1;
+
+    log_debug("Warm upstream %s://%s:%d ready", rps_proto_str(ctx->proto),
+            ctx->peername, rps_unresolve_port(&ctx->peer));
+}
+
+static void
+server_warm_connect_done(rps_ctx_t *ctx) {
+    if (!ctx->connected) {
+        server_warm_drop(ctx);
+        return;
+    }
+
+    server_ctx_set_proto(ctx, ctx->sess->upstream->proto);
+
+    if (server_read_start(ctx) != RPS_OK) {
+        server_warm_drop(ctx);
+        return;
+    }
+
+    ctx->state = c_handshake_req;
+    server_do_next(ctx);
+}
+
+/*
+ * Socks5 warm connection go through method negotiation and auth, stop
+ * before the request. The others only connect, their first message already
+ * carries the request of session.
+ */
+static void
+server_warm_do_next(rps_ctx_t *ctx) {
+    struct server_warm *w;
+
+    w = (struct server_warm *)ctx->sess;
+
+    switch (ctx->state) {
+    case c_conn:
+        server_warm_connect_done(ctx);
+        break;
+    case c_handshake_req:
+    case c_requests:
+        if (w->parked) {
+            /* data from upstream before any request */
+            server_warm_drop(ctx);
+        } else if (ctx->state == c_handshake_req && ctx->proto == SOCKS5) {
+            ctx->do_next(ctx);
+        } else {
+            server_warm_park(ctx);
+        }
+        break;
+    case c_handshake_resp:
+    case c_auth_req:
+    case c_auth_resp:
+        ctx->do_next(ctx);
+        break;
+    case c_closing:
+        break;
+    case c_closed:
+        server_warm_free(ctx);
+        break;
+    default:
+        /* Warm connection is never retried, the next selection tops up */
+        server_warm_drop(ctx);
+        break;
+    }
+}
 
-    ASSERT(!ctx->connected);
-    ASSERT(!ctx->connecting);
+static rps_status_t
+server_warm_spawn(struct server *s, struct upstream *u, uint64_t demand) {
+    struct server_warm *w;
+    rps_ctx_t *ctx;
 
-    //uv_tcp_init must be called before call uv_tcp_connect each time.
-    uv_tcp_init(&ctx->sess->server->loop, &ctx->handle.tcp);
+    w = (struct server_warm *)rps_alloc(sizeof(*w));
+    if (w == NULL) {
+        return RPS_ENOMEM;
+    }
 
-    err = uv_tcp_connect(&ctx->connect_req, 
-            &ctx->handle.tcp, 
-            (const struct sockaddr *)&ctx->peer.addr,
-            server_on_connect_done);
+    memset(&w->upstream, 0, sizeof(w->upstream));
+    memcpy(&w->upstream.server, &u->server, sizeof(u->server));
+    w->upstream.proto = u->proto;
+    string_init(&w->upstream.uname);
+    string_init(&w->upstream.passwd);
 
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "tcp connect %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
+    if ((!string_empty(&u->uname) && string_copy(&w->upstream.uname, &u->uname) != RPS_OK) ||
+        (!string_empty(&u->passwd) && string_copy(&w->upstream.passwd, &u->passwd) != RPS_OK)) {
+        goto error;
+    }
+
+    ctx = (struct context *)object_get(&s->contexts);
+    if (ctx == NULL) {
+        goto error;
+    }
+
+    server_sess_init(&w->sess, s);
+    w->sess.forward = ctx;
+    w->sess.upstream = &w->upstream;
+    w->ctx = ctx;
+    w->demand = demand;
+    w->parked = 0;
+    w->closing = 0;
+
+    w->next = s->warm;
+    s->warm = w;
+    s->nwarm++;
+
+    server_ctx_init(ctx, &w->sess, c_forward, s->ftimeout);
+    ctx->warm = 1;
+    ctx->state = c_conn;
+
+    uv_timer_init(&s->loop, &ctx->timer);
+
+    memcpy(&ctx->peer, &u->server, sizeof(u->server));
+
+    if (rps_unresolve_addr(&ctx->peer, ctx->peername) != RPS_OK) {
+        server_warm_drop(ctx);
         return RPS_ERROR;
     }
 
-    ctx->connecting = 1;
+    if (server_connect(ctx) != RPS_OK) {
+        /* tcp handle has been initialized, be closed as well */
+        ctx->connecting = 1;
+        server_warm_drop(ctx);
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+
+error:
+    string_deinit(&w->upstream.uname);
+    string_deinit(&w->upstream.passwd);
+    rps_free(w);
+    return RPS_ENOMEM;
+}
+
+/*
+ * Claim a parked connection to upstream u and top its stock up again,
+ * return NULL if none ready. Every selection keeps the stock in demand.
+ */
+static struct server_warm *
+server_warm_get(struct server *s, struct upstream *u) {
+    struct server_warm *w, *claimed;
+    uint64_t now;
+    uint32_t n;
+
+    if (s->upstreams->warm == 0) {
+        return NULL;
+    }
+
+    now = uv_now(&s->loop);
+    claimed = NULL;
+    n = 0;
+
+    for (w = s->warm; w != NULL; w = w->next) {
+        if (w->closing || !server_warm_match(&w->upstream, u)) {
+            continue;
+        }
+
+        w->demand = now;
+
+        if (claimed == NULL && w->parked) {
+            claimed = w;
+            continue;
+        }
+
+        n++;
+    }
+
+    while (n < s->upstreams->warm && s->nwarm < SERVER_WARM_MAX) {
+        if (server_warm_spawn(s, u, now) != RPS_OK) {
+            break;
+        }
+        n++;
+    }
+
+    return claimed;
+}
+
+/*
+ * Hand the warm connection over to the session of forward. The blank
+ * forward takes its place in warm entry and be retired by the warm path.
+ */
+static rps_ctx_t *
+server_warm_adopt(rps_ctx_t *forward, struct server_warm *w) {
+    rps_sess_t *sess;
+    rps_ctx_t *ctx;
+
+    sess = forward->sess;
+    ctx = w->ctx;
+
+    ctx->sess = sess;
+    ctx->warm = 0;
+    ctx->timeout = forward->timeout;
+    ctx->retry = forward->retry;
+    ctx->reconn = 0;
+    sess->forward = ctx;
+
+    forward->sess = &w->sess;
+    forward->warm = 1;
+    w->sess.forward = forward;
+    w->ctx = forward;
+    w->parked = 0;
+    w->closing = 1;
+
+    /* Only the timer of blank forward is alive */
+    server_ctx_close(forward);
 
     server_timer_reset(ctx);
 
-    return RPS_OK;
+    return ctx;
+}
+
+static int
+server_hedge_cmp(const void *a, const void *b) {
+    uint32_t x, y;
+
+    x = *(const uint32_t *)a;
+    y = *(const uint32_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Record setup time of established session, hedge delay follow the p90 */
+static void
+server_hedge_sample(struct server *s, uint32_t ms) {
+    uint32_t sorted[SERVER_HEDGE_SAMPLES];
+    uint32_t n;
+
+    if (!s->upstreams->hedge) {
+        return;
+    }
+
+    s->setup[s->nsetup % SERVER_HEDGE_SAMPLES] = ms;
+    s->nsetup++;
+
+    if (s->nsetup % SERVER_HEDGE_UPDATE != 0) {
+        return;
+    }
+
+    n = MIN(s->nsetup, SERVER_HEDGE_SAMPLES);
+    memcpy(sorted, s->setup, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), server_hedge_cmp);
+
+    s->hedge_delay = sorted[n * 9 / 10];
+}
+
+static void
+server_hedge_unlink(struct server *s, struct server_hedge *h) {
+    if (h->prev != NULL) {
+        h->prev->next = h->next;
+    } else {
+        s->hedge_head = h->next;
+    }
+
+    if (h->next != NULL) {
+        h->next->prev = h->prev;
+    } else {
+        s->hedge_tail = h->prev;
+    }
+
+    h->prev = NULL;
+    h->next = NULL;
+}
+
+/* Close the attempt, the upstream is failed or be cancelled */
+static void
+server_hedge_drop(rps_ctx_t *ctx, bool failed) {
+    struct server_hedge *h;
+    struct server *s;
+    uint32_t elapsed;
+
+    h = (struct server_hedge *)ctx->sess;
+    s = h->sess.server;
+
+    if (h->owner != NULL) {
+        h->owner->hedge = NULL;
+        h->owner = NULL;
+    }
+
+    /* owner's request may be freed before the attempt closed */
+    h->sess.request = NULL;
+
+    if (h->sess.upstream != NULL) {
+        elapsed = (uint32_t)(uv_now(&s->loop) - h->sess.connect_start);
+        if (failed) {
+            upstreams_mark_failure(s->upstreams, h->sess.upstream, elapsed, false);
+        } else {
+            upstreams_mark_cancel(s->upstreams, h->sess.upstream, elapsed);
+        }
+        h->sess.upstream = NULL;
+    }
+
+    server_ctx_close(ctx);
+}
+
+static void
+server_hedge_free(rps_ctx_t *ctx) {
+    struct server_hedge *h;
+    struct server *s;
+
+    h = (struct server_hedge *)ctx->sess;
+    s = h->sess.server;
+
+    object_put(&s->contexts, ctx);
+    object_put(&s->hedges, h);
 }
 
+/* Called on owner established or closed, the attempt loses */
+static void
+server_hedge_cancel(rps_sess_t *sess) {
+    struct server_hedge *h;
+
+    h = sess->hedge;
+    if (h == NULL) {
+        return;
+    }
+
+    sess->hedge = NULL;
+
+    if (h->ctx == NULL) {
+        server_hedge_unlink(sess->server, h);
+        object_put(&sess->server->hedges, h);
+        return;
+    }
+
+    server_hedge_drop(h->ctx, false);
+}
 
 /*
- *         request            forward
- * Client  ------->    RPS  ----------> Upstream ----> Remote
- *         context            context
- *  |                                      |
- *  |  ---          session          ---   |
+ * The attempt established first, swap it with the forward of owner. The
+ * old forward takes the shadow session and be closed as the loser.
  */
+static void
+server_hedge_win(rps_ctx_t *ctx) {
+    struct server_hedge *h;
+    rps_sess_t *owner;
+    rps_ctx_t *loser;
+    struct upstream *u;
+    uint64_t connect_start, connected;
+
+    h = (struct server_hedge *)ctx->sess;
+    owner = h->owner;
+    loser = owner->forward;
+
+    log_debug("Hedge upstream %s:%d won over %s:%d", ctx->peername,
+            rps_unresolve_port(&ctx->peer), loser->peername, rps_unresolve_port(&loser->peer));
+
+    u = h->sess.upstream;
+    connect_start = h->sess.connect_start;
+    connected = h->sess.connected;
+
+    h->sess.upstream = owner->upstream;
+    h->sess.connect_start = owner->connect_start;
+    h->sess.forward = loser;
+    h->ctx = loser;
+    loser->sess = &h->sess;
+    loser->hedge = 1;
+
+    owner->upstream = u;
+    owner->connect_start = connect_start;
+    owner->connected = connected;
+    owner->forward = ctx;
+    ctx->sess = owner;
+    ctx->hedge = 0;
+    ctx->retry = 0;
+    ctx->reconn = 0;
+
+    owner->server->metrics.hedge_won++;
+
+    server_hedge_drop(loser, false);
+
+    server_do_next(ctx);
+}
 
 static void
-server_on_request_connect(uv_stream_t *us, int err) {
+server_hedge_connect_done(rps_ctx_t *ctx) {
+    struct server_hedge *h;
+
+    h = (struct server_hedge *)ctx->sess;
+
+    if (!ctx->connected) {
+        server_hedge_drop(ctx, true);
+        return;
+    }
+
+    h->sess.connected = uv_now(&h->sess.server->loop);
+    upstreams_mark_connected(h->sess.server->upstreams, h->sess.upstream,
+            (uint32_t)(h->sess.connected - h->sess.connect_start));
+
+    server_ctx_set_proto(ctx, h->sess.upstream->proto);
+
+    if (server_read_start(ctx) != RPS_OK) {
+        server_hedge_drop(ctx, true);
+        return;
+    }
+
+    ctx->state = c_handshake_req;
+    server_do_next(ctx);
+}
+
+static void
+server_hedge_do_next(rps_ctx_t *ctx) {
+    switch (ctx->state) {
+    case c_conn:
+        server_hedge_connect_done(ctx);
+        break;
+    case c_establish:
+        server_hedge_win(ctx);
+        break;
+    case c_retry:
+    case c_failed:
+    case c_kill:
+    case c_will_kill:
+        /* The attempt is never retried, the forward keeps going */
+        server_hedge_drop(ctx, true);
+        break;
+    case c_closing:
+        break;
+    case c_closed:
+        server_hedge_free(ctx);
+        break;
+    default:
+        if (ctx->do_next != NULL) {
+            ctx->do_next(ctx);
+        }
+        break;
+    }
+}
+
+/* Start the second attempt on another upstream */
+static void
+server_hedge_start(struct server_hedge *h) {
     struct server *s;
-    rps_sess_t *sess;
-    rps_ctx_t *request; /* client -> rps */
-    int len;
-    rps_status_t status;
+    rps_sess_t *owner;
+    rps_ctx_t *forward, *ctx;
+    char key[UPSTREAM_KEY_MAX_LENGTH];
+    size_t len;
 
-    if (err) {
-        UV_SHOW_ERROR(err, "on new connect");
+    owner = h->owner;
+    s = owner->server;
+    forward = owner->forward;
+
+    ctx = (struct context *)object_get(&s->contexts);
+    if (ctx == NULL) {
+        goto cancel;
+    }
+
+    server_sess_init(&h->sess, s);
+    h->sess.request = owner->request;
+    h->sess.forward = ctx;
+    memcpy(&h->sess.remote, &owner->remote, sizeof(owner->remote));
+
+    server_ctx_init(ctx, &h->sess, c_forward, s->ftimeout);
+    ctx->hedge = 1;
+    ctx->state = c_conn;
+
+    /* Hash the next attempt number, a different upstream be selected */
+    ctx->retry = forward->retry + forward->reconn + 1;
+    len = server_sess_hash_key(&h->sess, key, sizeof(key));
+
+    h->sess.upstream = upstreams_get(s->upstreams, owner->request->proto,
+            len > 0 ? key : NULL, len);
+    if (h->sess.upstream == NULL) {
+        object_put(&s->contexts, ctx);
+        goto cancel;
+    }
+
+    if (h->sess.upstream == owner->upstream) {
+        upstreams_mark_cancel(s->upstreams, h->sess.upstream, 0);
+        object_put(&s->contexts, ctx);
+        goto cancel;
+    }
+
+    h->ctx = ctx;
+    h->sess.connect_start = uv_now(&s->loop);
+    s->metrics.hedged++;
+
+    uv_timer_init(&s->loop, &ctx->timer);
+
+    memcpy(&ctx->peer, &h->sess.upstream->server, sizeof(h->sess.upstream->server));
+
+    if (rps_unresolve_addr(&ctx->peer, ctx->peername) != RPS_OK) {
+        server_hedge_drop(ctx, true);
         return;
     }
 
-    s = (struct server*)us->data;
+    log_debug("Hedge upstream %s:%d after %llu ms", ctx->peername, rps_unresolve_port(&ctx->peer), 
+            (unsigned long long)(h->sess.connect_start - owner->connect_start));
 
-    if (s->conn_count >= MAX_CONNECTIONS) {
-        log_warn("max connections (%d) reached, rejecting new connection.", MAX_CONNECTIONS);
-        uv_tcp_t tmp;
-        uv_tcp_init(&s->loop, &tmp);
-        uv_accept(us, (uv_stream_t *)&tmp);
-        uv_close((uv_handle_t *)&tmp, NULL);
+    if (server_connect(ctx) != RPS_OK) {
+        /* tcp handle has been initialized, be closed as well */
+        ctx->connecting = 1;
+        server_hedge_drop(ctx, true);
+    }
+
+    return;
+
+cancel:
+    owner->hedge = NULL;
+    object_put(&s->hedges, h);
+}
+
+static void
+server_hedge_on_timer(uv_timer_t *handle) {
+    struct server *s;
+    struct server_hedge *h;
+    uint64_t now;
+
+    s = handle->data;
+    now = uv_now(&s->loop);
+
+    while ((h = s->hedge_head) != NULL && h->at <= now) {
+        server_hedge_unlink(s, h);
+        server_hedge_start(h);
+    }
+
+    if (s->hedge_head != NULL) {
+        uv_timer_start(&s->hedge_timer, (uv_timer_cb)server_hedge_on_timer,
+                s->hedge_head->at - now, 0);
+    }
+}
+
+/*
+ * Arm the hedge at first connect attempt of session. Http upstream isn't
+ * hedged, its handshake is the request itself which mustn't be sent twice.
+ */
+static void
+server_hedge_arm(rps_sess_t *sess) {
+    struct server *s;
+    struct server_hedge *h, *prev;
+    uint32_t delay;
+
+    s = sess->server;
+
+    if (!s->upstreams->hedge || sess->hedge != NULL || sess->upstream->proto == HTTP) {
+        return;
+    }
+
+    /* p90 of setup time, floored by the configured delay */
+    delay = MAX(s->hedge_delay, s->upstreams->hedge_delay);
+
+    h = (struct server_hedge *)object_get(&s->hedges);
+    if (h == NULL) {
         return;
     }
 
-    sess = (struct session*)rps_alloc(sizeof(struct session));
-    if (sess == NULL) {
-        return;
-    }
-    server_sess_init(sess, s);
-    s->conn_count++;
+    h->owner = sess;
+    h->ctx = NULL;
+    h->at = uv_now(&s->loop) + delay;
+
+    /*
+     * Keep the list in at order, the delay adapts so a later one may be due
+     * earlier. Mostly appended, walk back from the tail.
+     */
+    for (prev = s->hedge_tail; prev != NULL && prev->at > h->at; prev = prev->prev);
+
+    h->prev = prev;
+    h->next = prev != NULL ? prev->next : s->hedge_head;
+
+    if (h->next != NULL) {
+        h->next->prev = h;
+    } else {
+        s->hedge_tail = h;
+    }
+
+    if (prev != NULL) {
+        prev->next = h;
+    } else {
+        /* new head, the timer follows the earliest one */
+        s->hedge_head = h;
+        uv_timer_start(&s->hedge_timer, (uv_timer_cb)server_hedge_on_timer, delay, 0);
+    }
+
+    sess->hedge = h;
+}
+
+/*
+ * Health probe of an upstream, go through the client state machine of its
+ * proto against the probe target and be closed once established. A private
+ * session owns it, the request context is never connected and only carries
+ * the http request for http upstreams.
+ */
+struct server_probe {
+    rps_sess_t          sess;
+    rps_ctx_t           request;
+    struct http_request req;
+    rps_ctx_t           *ctx;
+};
+
+static void server_probe_fill(struct server *s);
+
+/* Mark the result once and close the probe */
+static void
+server_probe_done(rps_ctx_t *ctx, bool ok) {
+    struct server_probe *p;
+    struct server *s;
+
+    p = (struct server_probe *)ctx->sess;
+    s = p->sess.server;
+
+    if (p->sess.upstream != NULL) {
+        if (!ok) {
+            s->metrics.probe_failed++;
+        }
+
+        log_debug("Probe upstream %s:%d %s", ctx->peername, 
+                rps_unresolve_port(&ctx->peer), ok ? "success" : "failed");
+
+        upstreams_mark_probe(s->upstreams, p->sess.upstream, ok, 
+                (uint32_t)(uv_now(&s->loop) - p->sess.connect_start));
+        p->sess.upstream = NULL;
+    }
+
+    server_ctx_close(ctx);
+}
+
+static void
+server_probe_free(rps_ctx_t *ctx) {
+    struct server_probe *p;
+    struct server *s;
+
+    p = (struct server_probe *)ctx->sess;
+    s = p->sess.server;
+
+    object_put(&s->contexts, ctx);
+    http_request_deinit(&p->req);
+    rps_free(p);
+
+    s->nprobe--;
+    server_probe_fill(s);
+}
+
+static void
+server_probe_connect_done(rps_ctx_t *ctx) {
+    struct server_probe *p;
 
-    request = (struct context *)rps_alloc(sizeof(struct context));
-    if (request == NULL) {
-        rps_free(sess);
+    p = (struct server_probe *)ctx->sess;
+
+    if (!ctx->connected) {
+        server_probe_done(ctx, false);
         return;
     }
-    sess->request = request;
-    status = server_ctx_init(request, sess, c_request, s->rtimeout);
-    if (status != RPS_OK) {
-        rps_free(request);
-        rps_free(sess);
+
+    p->sess.connected = uv_now(&p->sess.server->loop);
+    upstreams_mark_connected(p->sess.server->upstreams, p->sess.upstream,
+            (uint32_t)(p->sess.connected - p->sess.connect_start));
+
+    server_ctx_set_proto(ctx, p->sess.upstream->proto);
+
+    if (server_read_start(ctx) != RPS_OK) {
+        server_probe_done(ctx, false);
         return;
     }
 
-    server_ctx_set_proto(request, s->proto);
-    
-    uv_tcp_init(&s->loop, &request->handle.tcp);
-    uv_timer_init(&s->loop, &request->timer);
+    ctx->state = c_handshake_req;
+    server_do_next(ctx);
+}
 
-    err = uv_accept(us, &request->handle.stream);
-    if (err) {
-        UV_SHOW_ERROR(err, "accept");
-        goto error;
+static void
+server_probe_do_next(rps_ctx_t *ctx) {
+    switch (ctx->state) {
+    case c_conn:
+        server_probe_connect_done(ctx);
+        break;
+    case c_establish:
+        server_probe_done(ctx, true);
+        break;
+    case c_retry:
+    case c_failed:
+    case c_kill:
+    case c_will_kill:
+        /* The probe is never retried, the next round checks again */
+        server_probe_done(ctx, false);
+        break;
+    case c_closing:
+        break;
+    case c_closed:
+        server_probe_free(ctx);
+        break;
+    default:
+        if (ctx->do_next != NULL) {
+            ctx->do_next(ctx);
+        }
+        break;
     }
+}
 
-    request->connecting = 1;
-    request->connected = 1;
+/* The probe target as a plain http request, the remote of socks5 derives from it */
+static rps_status_t
+server_probe_request(struct server *s, struct http_request *req) {
+    char message[SERVER_PROBE_REQUEST_SIZE];
+    int len;
 
-    #ifdef REQUEST_TCP_KEEPALIVE
-    err = uv_tcp_keepalive(&request->handle, 1, TCP_KEEPALIVE_DELAY);
-    if (err) {
-        UV_SHOW_ERROR(err, "set tcp keepalive");
-        goto error;
+    len = snprintf(message, sizeof(message), "GET http://%s/ HTTP/1.1\r\nHost: %s\r\n\r\n",
+            s->upstreams->check_target.data, s->upstreams->check_target.data);
+    if (len < 0 || (size_t)len >= sizeof(message)) {
+        return RPS_ERROR;
     }
-    #endif
 
-    
-    /*
-     * Get client address info.
-     */
-    len = (int)s->listen.addrlen;
-    err = uv_tcp_getpeername(&request->handle.tcp, 
-            (struct sockaddr *)&request->peer.addr, &len);
-    if (err) {
-        UV_SHOW_ERROR(err, "getpeername");
-        goto error;
-    }
-    request->peer.family = s->listen.family;
-    request->peer.addrlen = len;
-    
-    err = rps_unresolve_addr(&request->peer, request->peername);
-    if (err < 0) {
-        log_error("unresolve peername failer.");
-        goto error;
+    return http_request_parse(req, (uint8_t *)message, (size_t)len);
+}
+
+static rps_status_t
+server_probe_start(struct server *s, struct upstream *u) {
+    struct server_probe *p;
+    rps_ctx_t *ctx;
+
+    p = (struct server_probe *)rps_alloc(sizeof(*p));
+    if (p == NULL) {
+        return RPS_ENOMEM;
     }
 
-    log_debug("Accept request from %s:%d", request->peername, rps_unresolve_port(&request->peer));
+    http_request_init(&p->req);
 
-    request->state = c_handshake_req;
+    if (server_probe_request(s, &p->req) != RPS_OK) {
+        http_request_deinit(&p->req);
+        rps_free(p);
+        return RPS_ERROR;
+    }
 
-    /*
-     * Beigin receive data
-     */
-    status = server_read_start(request);
-    if (status != RPS_OK) {
-        goto error;
+    ctx = (struct context *)object_get(&s->contexts);
+    if (ctx == NULL) {
+        http_request_deinit(&p->req);
+        rps_free(p);
+        return RPS_ENOMEM;
     }
 
-    return;
+    server_sess_init(&p->sess, s);
+    server_ctx_init(&p->request, &p->sess, c_request, 0);
+    p->request.req = &p->req;
+    p->sess.request = &p->request;
+    p->sess.forward = ctx;
+    p->sess.upstream = u;
+    p->ctx = ctx;
+    rps_addr_name(&p->sess.remote, p->req.host.data, p->req.host.len, p->req.port);
 
-error:
-    server_close(request->sess);
-    return;
-}
+    s->nprobe++;
+    s->metrics.probed++;
 
-static void
-server_switch(rps_sess_t *sess) {
-    struct server *s;
-    rps_ctx_t *request;  /* client -> rps */
-    rps_ctx_t *forward; /* rps -> upstream */
+    server_ctx_init(ctx, &p->sess, c_forward, s->ftimeout);
+    ctx->probe = 1;
+    ctx->state = c_conn;
 
-    //ASSERT(sess->forward == NULL);
-    // server_switch has been called, 
-    // however may double called due to request has invalid new data read.
-    if (sess->forward != NULL) {
-        return;
-    }
+    uv_timer_init(&s->loop, &ctx->timer);
 
-    s = sess->server;
-    request = sess->request;
-    /* request stop read, wait for upstream establishment finished */
-    // server_read_stop(request);
+    memcpy(&ctx->peer, &u->server, sizeof(u->server));
+    p->sess.connect_start = uv_now(&s->loop);
 
-    forward = (struct context *)rps_alloc(sizeof(struct context));
-    if (forward == NULL) {
-        request->state = c_kill;
-        server_do_next(request);
-        return;
+    if (rps_unresolve_addr(&ctx->peer, ctx->peername) != RPS_OK) {
+        server_probe_done(ctx, false);
+        return RPS_OK;
     }
 
-    if (server_ctx_init(forward, sess, c_forward,  s->ftimeout) != RPS_OK) {
-        request->state = c_kill;
-        server_do_next(request);
-        return;
+    if (server_connect(ctx) != RPS_OK) {
+        /* tcp handle has been initialized, be closed as well */
+        ctx->connecting = 1;
+        server_probe_done(ctx, false);
     }
-    sess->forward = forward;
-    
-    uv_timer_init(&s->loop, &forward->timer);
 
-    /*
-     *  conext switch from reuqest to forward 
-     */
-    forward->state = c_conn;
-    server_do_next(forward); 
+    return RPS_OK;
 }
 
+/* Keep probes of current round in flight up to the concurrency limit */
 static void
-server_on_forward_close(uv_handle_t* handle) {
-    rps_ctx_t *forward;
-    rps_ctx_t *request;
-
-    forward = handle->data;
-    request = forward->sess->request;
+server_probe_fill(struct server *s) {
+    struct upstream *u;
 
-    forward->connecting = 0;
-    forward->connected = 0;
-    forward->established = 0;
+    while (s->probing && s->nprobe < s->upstreams->check_concurrency) {
+        u = upstreams_probe_next(s->upstreams, s->prober, &s->probe_cursor);
+        if (u == NULL) {
+            s->probing = 0;
+            break;
+        }
 
-    /* request context may have been free during server_forward_reconn called */
-    if (request == NULL) {
-        server_ctx_close(forward);
-        return;
+        if (server_probe_start(s, u) != RPS_OK) {
+            upstreams_mark_cancel(s->upstreams, u, 0);
+            break;
+        }
     }
-
-    server_sess_upstream_mark_fail(forward->sess);
-
-    forward->state = c_conn;
-    server_do_next(forward);
-    return;
 }
 
+/* A round not finished in the interval goes on, the next one waits for it */
 static void
-server_forward_reconn(rps_ctx_t *forward) {
+server_probe_on_timer(uv_timer_t *handle) {
     struct server *s;
 
-    s = forward->sess->server;
+    s = handle->data;
 
-    forward->reconn += 1;
-    
-    if (forward->reconn > s->upstreams->maxreconn) {
-        goto kill;
+    if (!s->probing) {
+        s->probing = 1;
+        s->probe_cursor = 0;
     }
 
-    if (!forward->connecting) {
-        //reconnect directly
-        forward->state = c_conn;
-        server_do_next(forward);
+    server_probe_fill(s);
+}
+
+static void
+server_probe_init(struct server *s) {
+    struct http_request req;
+    rps_status_t status;
+
+    http_request_init(&req);
+    status = server_probe_request(s, &req);
+    http_request_deinit(&req);
+
+    if (status != RPS_OK) {
+        log_error("invalid upstream check target: %s", s->upstreams->check_target.data);
         return;
     }
 
-    forward->state = c_closing;
-
-    uv_read_stop(&forward->handle.stream);
-    uv_timer_stop(&forward->timer);
-    uv_close(&forward->handle.handle, server_on_forward_close);
-    return;
+    s->prober = upstreams_probe_register(s->upstreams);
 
-kill:
-    forward->state = c_kill;
-    server_do_next(forward);
+    uv_timer_init(&s->loop, &s->probe_timer);
+    s->probe_timer.data = s;
+    uv_timer_start(&s->probe_timer, (uv_timer_cb)server_probe_on_timer, 
+            s->upstreams->check_interval, s->upstreams->check_interval);
 }
 
 static void
 server_forward_connect(rps_ctx_t *forward) {
     struct server *s;
     struct session *sess;
+    struct server_warm *w;
+    char key[UPSTREAM_KEY_MAX_LENGTH];
+    size_t len;
 
     s = forward->sess->server;
     sess = forward->sess;
@@ -927,6 +3335,10 @@ server_forward_connect(rps_ctx_t *forward) {
         if (forward->connected) {
             server_ctx_set_proto(forward, sess->upstream->proto);
 
+            sess->connected = uv_now(&s->loop);
+            upstreams_mark_connected(s->upstreams, sess->upstream, 
+                    (uint32_t)(sess->connected - sess->connect_start));
+
             /* Connect success */
             log_debug("Connect upstream %s://%s:%d success", rps_proto_str(forward->proto), forward->peername, 
                     rps_unresolve_port(&forward->peer));
@@ -945,7 +3357,10 @@ server_forward_connect(rps_ctx_t *forward) {
         goto reconn;
     }
 
-    sess->upstream = upstreams_get(s->upstreams, sess->request->proto);
+    len = server_sess_hash_key(sess, key, sizeof(key));
+
+    sess->upstream = upstreams_get(s->upstreams, sess->request->proto, 
+            len > 0 ? key : NULL, len);
     if (sess->upstream == NULL) {
         log_debug("no available %s upstream proxy.", rps_proto_str(sess->request->proto));
         forward->state = c_failed;
@@ -954,6 +3369,26 @@ server_forward_connect(rps_ctx_t *forward) {
         return;
     }
 
+    sess->connect_start = uv_now(&s->loop);
+
+    if (forward->reconn + forward->retry == 0) {
+        server_hedge_arm(sess);
+    }
+
+    w = server_warm_get(s, sess->upstream);
+    if (w != NULL) {
+        forward = server_warm_adopt(forward, w);
+        sess->connected = sess->connect_start;
+        s->metrics.warm++;
+
+        log_debug("Claim warm upstream %s://%s:%d", rps_proto_str(forward->proto),
+                forward->peername, rps_unresolve_port(&forward->peer));
+
+        /* socks5 continue with request, the others send the first message */
+        server_do_next(forward);
+        return;
+    }
+
     memcpy(&forward->peer, &sess->upstream->server, sizeof(sess->upstream->server));
 
     if (rps_unresolve_addr(&forward->peer, forward->peername) != RPS_OK) {
@@ -1100,6 +3535,13 @@ server_establish_pipeline_tunnel(rps_sess_t *sess) {
 
 static void
 server_establish(rps_sess_t *sess) {
+    server_hedge_cancel(sess);
+
+    sess->established = uv_now(&sess->server->loop);
+    server_hedge_sample(sess->server, (uint32_t)(sess->established - sess->connect_start));
+    upstreams_mark_established(sess->server->upstreams, sess->upstream, 
+            (uint32_t)(sess->established - sess->connect_start));
+
     switch (sess->request->stream) {
     case c_tunnel:
         server_establish_tunnel(sess);
@@ -1120,12 +3562,10 @@ server_establish(rps_sess_t *sess) {
 
 static void
 server_cycle(rps_ctx_t *ctx) {
-    uint8_t    *data;
     size_t     size;
     rps_sess_t  *sess;
     rps_ctx_t   *endpoint;
 
-    data = (uint8_t *)ctx->rbuf;
     size = (size_t)ctx->nread;
 
     sess = ctx->sess;
@@ -1146,9 +3586,15 @@ server_cycle(rps_ctx_t *ctx) {
     if ((ssize_t)size < 0) {
 
         if ((ssize_t)size == UV_EOF) {
-            server_ctx_close(ctx);
+            /* 
+             * Half-close, pass the FIN on once endpoint's queue drained and
+             * keep relaying the opposite direction.
+             */
+            ctx->reof = 1;
+            uv_read_stop(&ctx->handle.stream);
+            ctx->rstat = c_stop;
+            server_rbuf_release(ctx);
             server_ctx_shutdown(endpoint);
-            server_sess_mark_success(sess);
         } else {
             ctx->state = c_kill;
             server_do_next(ctx);
@@ -1156,12 +3602,27 @@ server_cycle(rps_ctx_t *ctx) {
         return;
     }
     
-    if (server_write(endpoint, data, size) != RPS_OK) {
+    if (server_relay(endpoint, ctx, size) != RPS_OK) {
         ctx->state = c_kill;
         server_do_next(ctx);
         return;
     }
 
+    ctx->relayed += size;
+
+    if (ctx->flag == c_forward && sess->first_byte == 0) {
+        sess->first_byte = uv_now(&sess->server->loop);
+    }
+
+#ifdef SPLICE_F_MOVE
+    /* Writes may complete synchronously, check splice on relay path as well */
+    server_splice_start(sess);
+#endif
+
+#ifdef RPS_HAVE_IO_URING
+    server_uring_start(sess);
+#endif
+
 #ifdef RPS_DEBUG_OPEN
     log_verb("redirect %d bytes to %s:%d", 
             size, endpoint->peername, rps_unresolve_port(&endpoint->peer));
@@ -1199,6 +3660,21 @@ server_forward_retry(rps_ctx_t *forward) {
 void
 server_do_next(rps_ctx_t *ctx) {
 
+    if (ctx->warm) {
+        server_warm_do_next(ctx);
+        return;
+    }
+
+    if (ctx->hedge) {
+        server_hedge_do_next(ctx);
+        return;
+    }
+
+    if (ctx->probe) {
+        server_probe_do_next(ctx);
+        return;
+    }
+
     switch (ctx->state) {
         case c_exchange:
             server_switch(ctx->sess);
@@ -1239,28 +3715,193 @@ server_do_next(rps_ctx_t *ctx) {
 }
 
 
+static void
+server_stats(uv_timer_t *handle) {
+    struct server *s;
+    struct server_metrics *m;
+    char name[64];
+
+    s = handle->data;
+
+    snprintf(name, sizeof(name), "%s proxy worker %d, %u sessions,", 
+            s->cfg->proto.data, s->worker + 1, s->conn_count);
+
+    buffer_pool_stats(&s->buffers, name);
+
+    snprintf(name, sizeof(name), "%s proxy worker %d session pool", 
+            s->cfg->proto.data, s->worker + 1);
+    object_pool_stats(&s->sessions, name);
+
+    snprintf(name, sizeof(name), "%s proxy worker %d context pool", 
+            s->cfg->proto.data, s->worker + 1);
+    object_pool_stats(&s->contexts, name);
+
+    m = &s->metrics;
+    if (m->sessions > 0 || m->probed > 0) {
+        log_info("%s proxy worker %d, %u sessions finished, %u established, %u warm, "
+                "%u hedged, %u hedge won, hedge delay %u ms, %u probed, %u probe failed, up %llu bytes, down %llu bytes, avg accept %llu ms, connect %llu ms, "
+                "handshake %llu ms, first byte %llu ms, established %llu ms", 
+                s->cfg->proto.data, s->worker + 1, m->sessions, m->established, m->warm,
+                m->hedged, m->hedge_won, MAX(s->hedge_delay, s->upstreams->hedge_delay),
+                m->probed, m->probe_failed,
+                (unsigned long long)m->bytes_up, (unsigned long long)m->bytes_down,
+                (unsigned long long)(m->established ? m->t_accept / m->established : 0),
+                (unsigned long long)(m->established ? m->t_connect / m->established : 0),
+                (unsigned long long)(m->established ? m->t_handshake / m->established : 0),
+                (unsigned long long)(m->first_byte ? m->t_first_byte / m->first_byte : 0),
+                (unsigned long long)(m->established ? m->t_established / m->established : 0));
+        memset(m, 0, sizeof(*m));
+    }
+
+#ifdef RPS_HAVE_IO_URING
+    if (s->io_uring) {
+        log_info("%s proxy worker %d io_uring submits %llu, sqes %llu, cqes %llu", 
+                s->cfg->proto.data, s->worker + 1, 
+                (unsigned long long)s->ring.nsubmit, 
+                (unsigned long long)s->ring.nsqe, 
+                (unsigned long long)s->ring.ncqe);
+    }
+#endif
+}
+
+/* Release pooled objects which have been idle for a whole trim interval */
+static void
+server_pool_trim(uv_timer_t *handle) {
+    struct server *s;
+    uint32_t n;
+
+    s = handle->data;
+
+    n = object_pool_trim(&s->sessions);
+    n += object_pool_trim(&s->contexts);
+    n += object_pool_trim(&s->hedges);
+
+    if (n > 0) {
+        log_debug("%s proxy worker %d trim %u pooled objects", 
+                s->cfg->proto.data, s->worker + 1, n);
+    }
+}
+
+#ifdef SO_REUSEPORT
+/*
+ * Every worker of the listener owns a standalone socket bound on the same address,
+ * the kernel spread the incoming connections across the workers' loops.
+ */
+static rps_status_t
+server_reuseport(struct server *s) {
+    int fd, on;
+    int err;
+
+    fd = socket(s->listen.family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_error("create %s worker socket failed: %s", s->cfg->proto.data, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        log_error("setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        close(fd);
+        return RPS_ERROR;
+    }
+
+    err = uv_tcp_open(&s->us, fd);
+    if (err) {
+        UV_SHOW_ERROR(err, "tcp open");
+        close(fd);
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+#endif
+
 void 
 server_run(struct server *s) {
     int err;
 
+    upstreams_register(s->upstreams);
+
     /* wait for upstreams load success */
     uv_mutex_lock(&s->upstreams->mutex);
-    uv_cond_wait(&s->upstreams->ready, &s->upstreams->mutex);
+    while (!s->upstreams->once) {
+        uv_cond_wait(&s->upstreams->ready, &s->upstreams->mutex);
+    }
     uv_mutex_unlock(&s->upstreams->mutex);
 
+    if (s->role != s_acceptor) {
+        uv_timer_init(&s->loop, &s->trim_timer);
+        s->trim_timer.data = s;
+        uv_timer_start(&s->trim_timer, (uv_timer_cb)server_pool_trim, 
+                SERVER_POOL_TRIM_INTERVAL, SERVER_POOL_TRIM_INTERVAL);
+    }
+
+#ifdef RPS_HAVE_IO_URING
+    if (s->role != s_acceptor && s->io_uring) {
+        server_uring_init(s);
+    }
+#endif
+
+    if (s->role != s_acceptor && s->upstreams->hedge) {
+        uv_timer_init(&s->loop, &s->hedge_timer);
+        s->hedge_timer.data = s;
+    }
+
+    if (s->role != s_acceptor && s->upstreams->check_interval > 0) {
+        server_probe_init(s);
+    }
+
+    if (s->role != s_acceptor && s->stats > 0) {
+        uv_timer_init(&s->loop, &s->stats_timer);
+        s->stats_timer.data = s;
+        uv_timer_start(&s->stats_timer, (uv_timer_cb)server_stats, s->stats, s->stats);
+    }
+
+    if (s->role == s_worker) {
+        err = uv_read_start((uv_stream_t *)&s->ipc, 
+                (uv_alloc_cb)server_dispatch_alloc, (uv_read_cb)server_on_dispatch_read);
+        if (err) {
+            UV_SHOW_ERROR(err, "read dispatch channel");
+            exit(1);
+        }
+
+        log_notice("%s proxy worker %d/%d run on %s:%d via acceptor", s->cfg->proto.data, 
+                s->worker + 1, s->cfg->workers, s->cfg->listen.data, s->cfg->port);
+
+        uv_run(&s->loop, UV_RUN_DEFAULT);
+        return;
+    }
+
+#ifdef SO_REUSEPORT
+    if (s->role == s_standalone && s->cfg->workers > 1) {
+        if (server_reuseport(s) != RPS_OK) {
+            exit(1);
+        }
+    }
+#endif
+
     err = uv_tcp_bind(&s->us, (struct sockaddr *)&s->listen.addr, 0);
     if (err) {
         UV_SHOW_ERROR(err, "bind");
         exit(1);
     }
     
-    err = uv_listen((uv_stream_t*)&s->us, TCP_BACKLOG, server_on_request_connect);
+    err = uv_listen((uv_stream_t*)&s->us, TCP_BACKLOG, 
+            s->role == s_acceptor ? server_on_dispatch_connect : server_on_request_connect);
     if (err) {
         UV_SHOW_ERROR(err, "listen");
         exit(1);
     }
 
-    log_notice("%s proxy run on %s:%d", s->cfg->proto.data, s->cfg->listen.data, s->cfg->port);
+    if (s->role == s_acceptor) {
+        log_notice("%s proxy acceptor run on %s:%d, dispatch to %d workers", s->cfg->proto.data, 
+                s->cfg->listen.data, s->cfg->port, s->nworkers);
+    } else if (s->cfg->workers > 1) {
+        log_notice("%s proxy worker %d/%d run on %s:%d", s->cfg->proto.data, 
+                s->worker + 1, s->cfg->workers, s->cfg->listen.data, s->cfg->port);
+    } else {
+        log_notice("%s proxy run on %s:%d", s->cfg->proto.data, s->cfg->listen.data, s->cfg->port);
+    }
 
     uv_run(&s->loop, UV_RUN_DEFAULT);
 }
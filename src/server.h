@@ -6,6 +6,8 @@
 #include "util.h"
 #include "_string.h"
 #include "upstream.h"
+#include "buffer.h"
+#include "uring.h"
 
 #include <uv.h>
 
@@ -15,11 +17,58 @@
 #define TCP_KEEPALIVE_DELAY 120
 #define MAX_CONNECTIONS     10000
 
+#define SERVER_DISPATCH_BUF_SIZE    64
+
+#define SERVER_SESSION_POOL_MAX     1024
+#define SERVER_CONTEXT_POOL_MAX     2048
+#define SERVER_POOL_TRIM_INTERVAL   10000 /* ms */
+
+#define SERVER_SPLICE_PIPE_SIZE     65536
+#define SERVER_SPLICE_BATCH         16  /* splice calls per direction per event */
+
+#define SERVER_URING_ENTRIES        1024
+#define SERVER_URING_OP_POOL_MAX    2048
+
+#define SERVER_WARM_MAX             256 /* warm upstream connections per loop */
+
+#define SERVER_HEDGE_POOL_MAX       1024
+#define SERVER_HEDGE_SAMPLES        64  /* setup times the hedge delay derived from */
+#define SERVER_HEDGE_UPDATE         16  /* recompute hedge delay every n samples */
+
+/* Probe request line and host header, check target is host:port */
+#define SERVER_PROBE_REQUEST_SIZE   (2 * (MAX_HOSTNAME_LEN + 8) + 64)
+
+/* Sessions finished since last stats, phase times are sums in ms */
+struct server_metrics {
+    uint32_t                sessions;
+    uint32_t                established;
+    uint32_t                first_byte;     /* established sessions got a byte from remote */
+    uint32_t                warm;           /* warm upstream connections claimed */
+    uint32_t                hedged;         /* second attempts started */
+    uint32_t                hedge_won;      /* second attempts finished first */
+    uint32_t                probed;         /* upstream health probes started */
+    uint32_t                probe_failed;
+    uint64_t                bytes_up;       /* client to remote */
+    uint64_t                bytes_down;     /* remote to client */
+    uint64_t                t_accept;       /* accept to upstream connect start */
+    uint64_t                t_connect;
+    uint64_t                t_handshake;
+    uint64_t                t_first_byte;   /* established to first byte */
+    uint64_t                t_established;  /* established to finish */
+};
+
+enum server_role {
+    s_standalone,   /* listen and serve the connections itself */
+    s_acceptor,     /* listen and hand over the connections to workers */
+    s_worker,       /* serve the connections handed over by acceptor */
+};
 
 struct server {
     uv_loop_t               loop;
     uv_tcp_t                us; /* libuv tcp server */
 
+    uint8_t                 role;
+
     rps_proto_t             proto;
 
     rps_addr_t              listen;
@@ -29,19 +78,77 @@ struct server {
 
     uint32_t                conn_count; /* active connection count */
 
+    uint16_t                worker; /* worker index of the listener */
+
+    unsigned                splice:1; /* relay established tunnels by splice(2) */
+    unsigned                io_uring:1; /* relay established tunnels by io_uring */
+
+    struct uring            ring;
+    uv_poll_t               ring_poll;      /* ring fd readable while completions pending */
+    uv_prepare_t            ring_prepare;   /* submit sqes batched in loop iteration */
+    struct object_pool      uring_ops;
+
+    struct buffer_pool      buffers; /* read and write buffers of the loop's contexts */
+    struct object_pool      sessions;
+    struct object_pool      contexts;
+    uv_timer_t              trim_timer;
+
+    /* Upstream connections be connected and negotiated ahead of sessions */
+    struct server_warm      *warm;
+    uint32_t                nwarm;
+
+    /* Hedged connects armed but not started yet, oldest first */
+    struct object_pool      hedges;
+    struct server_hedge     *hedge_head;
+    struct server_hedge     *hedge_tail;
+    uv_timer_t              hedge_timer;
+    uint32_t                setup[SERVER_HEDGE_SAMPLES]; /* connect to established ms */
+    uint32_t                nsetup;
+    uint32_t                hedge_delay;    /* ms, p90 of setup samples */
+
+    /* Upstream health check, the loop probes its share of upstreams */
+    uv_timer_t              probe_timer;
+    uint32_t                prober;         /* index among probing loops */
+    uint32_t                probe_cursor;   /* position of current round */
+    uint32_t                nprobe;         /* probes in flight */
+    unsigned                probing:1;      /* current round not finished */
+
+    uint32_t                stats;  /* stats interval */
+    uv_timer_t              stats_timer;
+    struct server_metrics   metrics;
+
+    /* Acceptor dispatch mode, the acceptor pass the accepted socket to
+     * the worker loop which has fewest sessions via ipc pipe.
+     */
+    struct server           *workers; /* acceptor: worker servers */
+    uint16_t                nworkers;
+    uv_pipe_t               ipc;        /* worker: receive end, in worker loop */
+    uv_pipe_t               dispatcher; /* worker: send end, in acceptor loop */
+    uint32_t                dispatched; /* written by acceptor */
+    uint32_t                accepted;   /* written by worker */
+    char                    ipcbuf[SERVER_DISPATCH_BUF_SIZE];
+
     struct config_server    *cfg;
 
     struct upstreams        *upstreams;
 };
 
-rps_status_t server_init(struct server *s, struct config_server *cs, 
-        struct upstreams *us, uint32_t rtimeout, uint32_t ftimeout);
+rps_status_t server_init(struct server *s, struct config_servers *css, 
+        struct config_server *cs, struct upstreams *us, uint16_t worker);
 void server_deinit(struct server *s);
+rps_status_t server_dispatch_init(struct server *acceptor, 
+        struct server *workers, uint16_t n);
 void server_run(struct server *s);
 // void server_stop(struct server *);
 
 void server_do_next(rps_ctx_t *ctx);
 
 rps_status_t server_write(struct context *ctx, const void *data, size_t len);
+rps_status_t server_writev(struct context *ctx, const uv_buf_t *bufs, unsigned int nbufs);
+
+static inline bool
+server_acceptor_dispatch(struct config_server *cfg) {
+    return !string_empty(&cfg->dispatch) && rps_strcmp(&cfg->dispatch, "acceptor") == 0;
+}
 
 #endif
@@ -4,17 +4,34 @@
 #include "config.h"
 #include "_string.h"
 
+#include "murmur3/murmur3.h"
+
 #include <uv.h>
 #include <jansson.h>
 #include <curl/curl.h>
 
-typedef struct upstream * (*upstream_pool_get_algorithm)(struct upstream_pool *);
+/* Return the index in snapshot where the selection start */
+typedef uint32_t (*upstream_pool_get_algorithm)(struct upstreams *, struct upstream_pool *, 
+        struct upstream_snapshot *, struct upstream_reader *, uint32_t hash);
 
 struct curl_buf {
     uint8_t *buf;
     size_t  len;
 };
 
+struct upstream_ring_node {
+    uint32_t    hash;
+    uint32_t    idx;
+};
+
+/* heap node used to build the weighted round-robin schedule */
+struct upstream_wrr_node {
+    uint64_t    pass;
+    uint32_t    stride;
+    uint32_t    remain;
+    uint32_t    idx;
+};
+
 void
 upstream_init(struct upstream *u) {
     string_init(&u->uname);   
@@ -28,8 +45,33 @@ upstream_init(struct upstream *u) {
     u->insert_date = 0;
     u->expire_date = 0;
     u->enable = 0;
-
-    queue_null(&u->timewheel);
+    u->down = 0;
+    u->retire_next = NULL;
+    u->retire_epoch = 0;
+    u->shards = NULL;
+    u->nshards = 0;
+    u->agg_success = 0;
+    u->agg_failure = 0;
+    u->agg_count = 0;
+    u->bytes = 0;
+    u->connect_ms = 0;
+    u->transfer_ms = 0;
+    u->established = 0;
+    u->agg_bytes = 0;
+    u->agg_connect_ms = 0;
+    u->agg_transfer_ms = 0;
+    u->agg_established = 0;
+    u->breaker = up_breaker_closed;
+    u->breaker_opens = 0;
+    u->breaker_fails = 0;
+    u->breaker_trials = 0;
+    u->win_success = 0;
+    u->win_failure = 0;
+    u->win_start = 0;
+    u->breaker_until = 0;
+
+    u->limiter = NULL;
+    uv_mutex_init(&u->lock);
 }
 
 void
@@ -43,22 +85,149 @@ upstream_deinit(struct upstream *u) {
     u->insert_date = 0;
     u->expire_date = 0;
 
-    if (!queue_is_null(&u->timewheel)) {
-        queue_deinit(&u->timewheel);
+    if (u->limiter != NULL) {
+        rps_free(u->limiter);
+        u->limiter = NULL;
+    }
+    uv_mutex_destroy(&u->lock);
+
+    if (u->shards != NULL) {
+        rps_free(u->shards);
+        u->shards = NULL;
     }
+    u->nshards = 0;
 }
 
 static rps_status_t
-upstream_init_timewheel(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uint32_t mr1d) {
-    uint32_t n;
+upstream_init_shards(struct upstream *u, uint32_t n) {
+    size_t size;
 
-    n = MAX(MAX(mr1m, mr1h), mr1d);
-    
-    n = n > 0 ? n : UPSTREAM_DEFAULT_TIME_WHEEL_LENGTH;
+    n = MAX(n, 1);
+    size = n * sizeof(struct upstream_shard);
+
+    u->shards = rps_memalign(RPS_CACHELINE_SIZE, size);
+    if (u->shards == NULL) {
+        return RPS_ENOMEM;
+    }
+    memset(u->shards, 0, size);
+    u->nshards = n;
+
+    return RPS_OK;
+}
+
+/* Fold the shards increments since last time into the view. 
+ * Only the delta is added, so the view can still be adjusted by api and merge.
+ */
+static void
+upstream_aggregate(struct upstream *u) {
+    struct upstream_shard *shard;
+    uint32_t i, success, failure, count, established;
+    uint64_t bytes, connect_ms, transfer_ms;
+
+    success = 0;
+    failure = 0;
+    count = 0;
+    established = 0;
+    bytes = 0;
+    connect_ms = 0;
+    transfer_ms = 0;
+
+    for (i = 0; i < u->nshards; i++) {
+        shard = &u->shards[i];
+        success += rps_atomic_load(&shard->success);
+        failure += rps_atomic_load(&shard->failure);
+        count += rps_atomic_load(&shard->count);
+        established += rps_atomic_load(&shard->established);
+        bytes += rps_atomic_load(&shard->bytes);
+        connect_ms += rps_atomic_load(&shard->connect_ms);
+        transfer_ms += rps_atomic_load(&shard->transfer_ms);
+    }
+
+    rps_atomic_store(&u->success, u->success + (success - u->agg_success));
+    rps_atomic_store(&u->failure, u->failure + (failure - u->agg_failure));
+    u->count += count - u->agg_count;
+
+    u->agg_success = success;
+    u->agg_failure = failure;
+    u->agg_count = count;
+
+    u->established += established - u->agg_established;
+    u->bytes += bytes - u->agg_bytes;
+    u->connect_ms += connect_ms - u->agg_connect_ms;
+    u->transfer_ms += transfer_ms - u->agg_transfer_ms;
+
+    u->agg_established = established;
+    u->agg_bytes = bytes;
+    u->agg_connect_ms = connect_ms;
+    u->agg_transfer_ms = transfer_ms;
+}
+
+/* Sessions in flight right now, summed over the shards */
+static uint32_t
+upstream_inflight(struct upstream *u) {
+    struct upstream_shard *shard;
+    int64_t n;
+    uint32_t i;
+
+    n = 0;
+    for (i = 0; i < u->nshards; i++) {
+        shard = &u->shards[i];
+        n += (int64_t)rps_atomic_load(&shard->count) - rps_atomic_load(&shard->success) - 
+            rps_atomic_load(&shard->failure);
+    }
+
+    return n > 0 ? (uint32_t)n : 0;
+}
+
+/* Sessions still be using the upstream, as of last aggregation */
+static bool
+upstream_in_use(struct upstream *u) {
+    return u->agg_count != u->agg_success + u->agg_failure;
+}
+
+static rps_status_t
+upstream_init_limiter(struct upstream *u) {
+    u->limiter = rps_zalloc(sizeof(struct upstream_limiter));
+    if (u->limiter == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    u->limiter->last = rps_now();
+
+    return RPS_OK;
+}
+
+/* Expire buckets from ring start+1 to end, subtract them from total */
+static void
+upstream_limiter_expire(uint32_t *ring, uint32_t nring, uint32_t *total, 
+        rps_ts_t start, rps_ts_t end) {
+    rps_ts_t t;
+
+    if (end - start >= (rps_ts_t)nring) {
+        memset(ring, 0, nring * sizeof(*ring));
+        *total = 0;
+        return;
+    }
 
-    return queue_init(&u->timewheel, n);
+    for (t = start + 1; t <= end; t++) {
+        *total -= ring[t % nring];
+        ring[t % nring] = 0;
+    }
 }
 
+/* Slide the windows to now, amortized O(1) */
+static void
+upstream_limiter_advance(struct upstream_limiter *l, rps_ts_t now) {
+    if (now <= l->last) {
+        return;
+    }
+
+    upstream_limiter_expire(l->sec, UPSTREAM_LIMITER_SECS, &l->m, l->last, now);
+    upstream_limiter_expire(l->min, UPSTREAM_LIMITER_MINS, &l->h, l->last / 60, now / 60);
+    upstream_limiter_expire(l->hour, UPSTREAM_LIMITER_HOURS, &l->d, l->last / 3600, now / 3600);
+
+    l->last = now;
+}
 
 static void
 upstream_copy(struct upstream *dst, struct upstream *src) {
@@ -79,9 +248,34 @@ upstream_copy(struct upstream *dst, struct upstream *src) {
     dst->success = src->success;
     dst->failure = src->failure;
     dst->count = src->count;
+    dst->established = src->established;
+    dst->bytes = src->bytes;
+    dst->connect_ms = src->connect_ms;
+    dst->transfer_ms = src->transfer_ms;
     dst->insert_date = src->insert_date;
     dst->expire_date = src->expire_date;
     dst->enable = src->enable;
+
+    uv_mutex_lock(&src->lock);
+    if (src->limiter != NULL && dst->limiter == NULL) {
+        dst->limiter = rps_alloc(sizeof(struct upstream_limiter));
+        if (dst->limiter != NULL) {
+            memcpy(dst->limiter, src->limiter, sizeof(struct upstream_limiter));
+        }
+    }
+    uv_mutex_unlock(&src->lock);
+}
+
+/* Requests within last day */
+static uint32_t
+upstream_limiter_day(struct upstream *u) {
+    if (u->limiter == NULL) {
+        return 0;
+    }
+
+    upstream_limiter_advance(u->limiter, rps_now());
+
+    return u->limiter->d;
 }
 
 static int 
@@ -105,107 +299,731 @@ upstream_str(void *data) {
     rps_unresolve_addr(&u->server, name);
     log_verb("\t%s://%s:%s@%s:%d (s:%d, f:%d, c:%d, d:%d) expire_date:%d", rps_proto_str(u->proto), 
             u->uname.data, u->passwd.data, name, rps_unresolve_port(&u->server), 
-            u->success, u->failure, u->count, queue_n(&u->timewheel), u->expire_date);
+            u->success, u->failure, u->count, upstream_limiter_day(u), u->expire_date);
 }
 #endif
 
-static bool
-upstream_freshly(struct upstream *u) {
-    return queue_is_null(&u->timewheel);
+static uint32_t
+upstream_tick(void) {
+    return (uint32_t)(uv_hrtime() / (1000000ULL * UPSTREAM_HEALTH_TICK));
+}
+
+/* score * 2^(-elapsed/halflife), piecewise linear between the halvings */
+static uint32_t
+upstream_score_decay(uint32_t score, uint32_t elapsed, uint32_t halflife) {
+    uint32_t n;
+
+    /* decayed by another thread with a later tick */
+    if (elapsed > INT32_MAX) {
+        return score;
+    }
+
+    n = elapsed / halflife;
+    if (n >= 32) {
+        return 0;
+    }
+
+    score >>= n;
+
+    return score - (uint32_t)((uint64_t)score * (elapsed % halflife) / (2 * halflife));
+}
+
+/* Current value of a packed score */
+static uint32_t
+upstream_score(uint64_t *p, uint32_t now, uint32_t halflife) {
+    uint64_t v;
+
+    v = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+    return upstream_score_decay((uint32_t)v, now - (uint32_t)(v >> 32), halflife);
+}
+
+/* Decay to now and add one outcome, only the owner thread writes its shard */
+static void
+upstream_score_add(uint64_t *p, uint32_t halflife) {
+    uint64_t v;
+    uint32_t now, score;
+
+    now = upstream_tick();
+    v = *p;
+
+    score = upstream_score_decay((uint32_t)v, now - (uint32_t)(v >> 32), halflife);
+    score = score > UINT32_MAX - UPSTREAM_HEALTH_UNIT ? UINT32_MAX : score + UPSTREAM_HEALTH_UNIT;
+
+    rps_atomic_store(p, ((uint64_t)now << 32) | score);
+}
+
+/* Current scores summed over the shards, the same way as upstream_inflight */
+static void
+upstream_scores(struct upstreams *us, struct upstream *u, uint64_t *success, 
+        uint64_t *failure) {
+    struct upstream_shard *shard;
+    uint32_t i, now;
+
+    now = upstream_tick();
+    *success = 0;
+    *failure = 0;
+
+    for (i = 0; i < u->nshards; i++) {
+        shard = &u->shards[i];
+        *success += upstream_score(&shard->score_success, now, us->health_halflife);
+        *failure += upstream_score(&shard->score_failure, now, us->health_halflife);
+    }
+}
+
+/* 
+ * Recent success ratio in 1/UPSTREAM_HEALTH_ONE, one virtual success keeps
+ * the unmeasured and the barely measured ones near healthy.
+ */
+static uint32_t
+upstream_health(struct upstreams *us, struct upstream *u) {
+    uint64_t success, failure;
+
+    upstream_scores(us, u, &success, &failure);
+    success += UPSTREAM_HEALTH_UNIT;
+
+    return (uint32_t)(success * UPSTREAM_HEALTH_ONE / (success + failure));
+}
+
+/* Fail rate of the decayed scores, old outcomes weigh less */
+static bool
+upstream_poor_quality(struct upstreams *us, struct upstream *u) {
+    float fail_rate;
+    uint64_t success, failure;
+
+    if (us->max_fail_rate == 0.0) {
+        //ignore max_fail_rate if be setted to 0
+        return false;
+    }
+
+    upstream_scores(us, u, &success, &failure);
+
+    if (failure <= UPSTREAM_MIN_FAILURE * UPSTREAM_HEALTH_UNIT) {
+        return false;
+    }
+
+    fail_rate = failure / ((float)failure + success);
+
+    return fail_rate > us->max_fail_rate;
+}
+
+
+static bool
+upstream_request_too_often(struct upstream_limiter *l, uint32_t mr1m, uint32_t mr1h, uint32_t mr1d) {
+    upstream_limiter_advance(l, rps_now());
+
+    return ((mr1m != 0 && l->m >= mr1m) || 
+            (mr1h != 0 && l->h >= mr1h) || 
+            (mr1d != 0 && l->d >= mr1d));
+}
+
+static void
+upstream_limiter_add(struct upstream_limiter *l) {
+    l->sec[l->last % UPSTREAM_LIMITER_SECS] += 1;
+    l->min[(l->last / 60) % UPSTREAM_LIMITER_MINS] += 1;
+    l->hour[(l->last / 3600) % UPSTREAM_LIMITER_HOURS] += 1;
+    l->m += 1;
+    l->h += 1;
+    l->d += 1;
+}
+
+/* Check the request limit and account this request if allowed */
+static bool
+upstream_rate_limited(struct upstream *u, struct upstreams *us) {
+    bool limited;
+
+    if (us->mr1m == 0 && us->mr1h == 0 && us->mr1d == 0) {
+        return false;
+    }
+
+    uv_mutex_lock(&u->lock);
+
+    if (u->limiter == NULL && upstream_init_limiter(u) != RPS_OK) {
+        uv_mutex_unlock(&u->lock);
+        return true;
+    }
+
+    limited = upstream_request_too_often(u->limiter, us->mr1m, us->mr1h, us->mr1d);
+    if (!limited) {
+        upstream_limiter_add(u->limiter);
+    }
+
+    uv_mutex_unlock(&u->lock);
+
+    return limited;
+}
+
+static uint64_t
+upstream_msec(void) {
+    return uv_hrtime() / 1000000;
+}
+
+static void
+upstream_breaker_log(struct upstream *u, const char *state) {
+    char name[MAX_HOSTNAME_LEN];
+
+    rps_unresolve_addr(&u->server, name);
+    log_debug("upstream %s://%s:%d breaker %s", rps_proto_str(u->proto), 
+            name, rps_unresolve_port(&u->server), state);
+}
+
+/* Tumbling window, the first outcome after it expired starts a new one */
+static void
+upstream_breaker_window(struct upstream *u, uint64_t now) {
+    uint64_t start;
+
+    start = rps_atomic_load(&u->win_start);
+    if (now - start < UPSTREAM_BREAKER_WINDOW) {
+        return;
+    }
+
+    if (__atomic_compare_exchange_n(&u->win_start, &start, now, false, 
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        rps_atomic_store(&u->win_success, 0);
+        rps_atomic_store(&u->win_failure, 0);
+    }
+}
+
+/* 
+ * Open the breaker unless another thread changed its state already,
+ * the backoff doubles every time it reopens without a success between.
+ */
+static void
+upstream_breaker_trip(struct upstreams *us, struct upstream *u, 
+        uint8_t from, uint64_t now) {
+    uint8_t opens;
+    uint64_t backoff;
+
+    opens = rps_atomic_load(&u->breaker_opens);
+    backoff = (uint64_t)us->breaker_backoff << MIN(opens, UPSTREAM_BREAKER_MAX_SHIFT);
+
+    /* deadline first, readers check it once seen open */
+    rps_atomic_store(&u->breaker_until, now + backoff);
+
+    if (!__atomic_compare_exchange_n(&u->breaker, &from, up_breaker_open, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    rps_atomic_store(&u->breaker_opens, MIN(opens + 1, UINT8_MAX));
+    rps_atomic_store(&u->breaker_fails, 0);
+
+    upstream_breaker_log(u, "open");
+}
+
+/* A session failed on the upstream before or after established */
+static void
+upstream_breaker_failure(struct upstreams *us, struct upstream *u) {
+    uint32_t fails, failure;
+    uint64_t now;
+
+    if (us->breaker == 0) {
+        return;
+    }
+
+    now = upstream_msec();
+    upstream_breaker_window(u, now);
+
+    failure = rps_atomic_add(&u->win_failure, 1);
+    fails = rps_atomic_add(&u->breaker_fails, 1);
+
+    switch (rps_atomic_load(&u->breaker)) {
+    case up_breaker_closed:
+        if (fails >= us->breaker || (failure >= 2 * us->breaker && 
+                    failure > rps_atomic_load(&u->win_success))) {
+            upstream_breaker_trip(us, u, up_breaker_closed, now);
+        }
+        break;
+    case up_breaker_half_open:
+        /* a failed trial reopens at once */
+        upstream_breaker_trip(us, u, up_breaker_half_open, now);
+        break;
+    default:
+        /* sessions started before opened */
+        break;
+    }
+}
+
+/* A session established through the upstream */
+static void
+upstream_breaker_success(struct upstreams *us, struct upstream *u) {
+    uint8_t state;
+
+    if (us->breaker == 0) {
+        return;
+    }
+
+    upstream_breaker_window(u, upstream_msec());
+    rps_atomic_add(&u->win_success, 1);
+
+    /* avoid dirtying the shared line on every success */
+    if (rps_atomic_load(&u->breaker_fails) != 0) {
+        rps_atomic_store(&u->breaker_fails, 0);
+    }
+
+    state = rps_atomic_load(&u->breaker);
+    if (state == up_breaker_closed) {
+        return;
+    }
+
+    if (__atomic_compare_exchange_n(&u->breaker, &state, up_breaker_closed, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        rps_atomic_store(&u->breaker_opens, 0);
+        upstream_breaker_log(u, "closed");
+    }
+}
+
+/* Open and still backing off, checked before the rate limiter spends a request */
+static bool
+upstream_breaker_blocked(struct upstream *u) {
+    return rps_atomic_load(&u->breaker) == up_breaker_open && 
+        upstream_msec() < rps_atomic_load(&u->breaker_until);
+}
+
+/* 
+ * Whether the breaker let a session through. Once the backoff passed it 
+ * turns half open and admits a few trials, if none of them reports in time 
+ * (cancelled by hedge for instance) another round of trials is admitted.
+ */
+static bool
+upstream_breaker_allow(struct upstreams *us, struct upstream *u) {
+    uint8_t state;
+    uint64_t now, until;
+
+    state = rps_atomic_load(&u->breaker);
+    if (state == up_breaker_closed) {
+        return true;
+    }
+
+    now = upstream_msec();
+    until = rps_atomic_load(&u->breaker_until);
+
+    if (now < until) {
+        if (state == up_breaker_open) {
+            return false;
+        }
+    } else if (__atomic_compare_exchange_n(&u->breaker_until, &until, 
+                now + us->breaker_backoff, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        rps_atomic_store(&u->breaker_trials, 0);
+        if (__atomic_compare_exchange_n(&u->breaker, &state, up_breaker_half_open, 
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) && 
+                state == up_breaker_open) {
+            upstream_breaker_log(u, "half open");
+        }
+    }
+
+    return rps_atomic_fetch_add(&u->breaker_trials, 1) < UPSTREAM_BREAKER_TRIALS;
+}
+
+static struct upstream_snapshot *
+upstream_snapshot_create(rps_hashmap_t *pool) {
+    struct upstream_snapshot *snap;
+    struct upstream *u;
+    struct hashmap_entry *e;
+    uint32_t i, n, tail;
+
+    n = hashmap_n(pool);
+
+    snap = rps_alloc(sizeof(*snap) + n * sizeof(struct upstream *));
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    snap->n = 0;
+    snap->total = 0;
+    snap->retire_epoch = 0;
+    snap->retire_next = NULL;
+    snap->schedule = NULL;
+    snap->ring = NULL;
+    snap->nschedule = 0;
+
+    /* 
+     * Only the enabled upstreams are eligible for selection, the down ones 
+     * are filled from the end and moved after them, to be probed still.
+     */
+    tail = n;
+    for (i = 0; i < pool->size; i++) {
+        for (e = pool->buckets[i]; e != NULL; e = e->next) {
+            u = (struct upstream *)*(void **)e->value;
+            if (!rps_atomic_load(&u->enable)) {
+                continue;
+            }
+            if (rps_atomic_load(&u->down)) {
+                snap->elts[--tail] = u;
+            } else {
+                snap->elts[snap->n++] = u;
+            }
+        }
+    }
+
+    ASSERT(snap->n <= tail);
+
+    memmove(&snap->elts[snap->n], &snap->elts[tail], (n - tail) * sizeof(struct upstream *));
+    snap->total = snap->n + (n - tail);
+
+    return snap;
+}
+
+static void
+upstream_snapshot_free(struct upstream_snapshot *snap) {
+    if (snap->schedule != NULL) {
+        rps_free(snap->schedule);
+    }
+    if (snap->ring != NULL) {
+        rps_free(snap->ring);
+    }
+    rps_free(snap);
+}
+
+static uint32_t
+upstream_gcd(uint32_t a, uint32_t b) {
+    uint32_t t;
+
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+static bool
+upstream_wrr_node_less(struct upstream_wrr_node *a, struct upstream_wrr_node *b) {
+    return a->pass < b->pass || (a->pass == b->pass && a->idx < b->idx);
+}
+
+static void
+upstream_wrr_sift_down(struct upstream_wrr_node *heap, uint32_t n, uint32_t i) {
+    struct upstream_wrr_node tmp;
+    uint32_t l, r, min;
+
+    for (;;) {
+        l = 2 * i + 1;
+        r = l + 1;
+        min = i;
+
+        if (l < n && upstream_wrr_node_less(&heap[l], &heap[min])) {
+            min = l;
+        }
+        if (r < n && upstream_wrr_node_less(&heap[r], &heap[min])) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/*
+ * Precompute the smooth weighted round-robin sequence, so a wrr pick is 
+ * a single index operation. Each upstream appears exactly weight times, 
+ * interleaved by stride scheduling: always emit the one with the smallest 
+ * pass, then advance its pass by stride (inversely proportional to weight).
+ * Weights are reduced by their gcd, and scaled down when the sequence would 
+ * be longer than UPSTREAM_WRR_MAX_SCHEDULE. Weight 0 is taken as 1.
+ */
+static rps_status_t
+upstream_snapshot_schedule(struct upstream_snapshot *snap) {
+    struct upstream_wrr_node *heap;
+    uint64_t total;
+    uint32_t i, n, w, g;
+
+    if (snap->n == 0) {
+        return RPS_OK;
+    }
+
+    heap = rps_alloc(snap->n * sizeof(*heap));
+    if (heap == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    g = 0;
+    total = 0;
+    for (i = 0; i < snap->n; i++) {
+        w = MAX(snap->elts[i]->weight, 1);
+        g = upstream_gcd(w, g);
+        total += w;
+    }
+    total /= g;
+
+    n = 0;
+    for (i = 0; i < snap->n; i++) {
+        w = MAX(snap->elts[i]->weight, 1) / g;
+        if (total > UPSTREAM_WRR_MAX_SCHEDULE) {
+            w = MAX((uint64_t)w * UPSTREAM_WRR_MAX_SCHEDULE / total, 1);
+        }
+        heap[i].stride = UPSTREAM_WRR_STRIDE / w;
+        heap[i].pass = heap[i].stride / 2;
+        heap[i].remain = w;
+        heap[i].idx = i;
+        n += w;
+    }
+
+    snap->schedule = rps_alloc(n * sizeof(uint32_t));
+    if (snap->schedule == NULL) {
+        rps_free(heap);
+        return RPS_ENOMEM;
+    }
+
+    for (i = snap->n / 2; i > 0; i--) {
+        upstream_wrr_sift_down(heap, snap->n, i - 1);
+    }
+
+    i = snap->n;
+    while (i > 0) {
+        snap->schedule[snap->nschedule++] = heap[0].idx;
+
+        if (--heap[0].remain == 0) {
+            heap[0] = heap[--i];
+        } else {
+            heap[0].pass += heap[0].stride;
+        }
+        upstream_wrr_sift_down(heap, i, 0);
+    }
+
+    ASSERT(snap->nschedule == n);
+
+    rps_free(heap);
+
+    return RPS_OK;
+}
+
+static int
+upstream_ring_node_cmp(const void *a, const void *b) {
+    const struct upstream_ring_node *x = a, *y = b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+/*
+ * Build the consistent hash ring, each upstream is placed at 
+ * UPSTREAM_HASH_VNODES points hashed from its key, so a refresh 
+ * only moves about 1/n of the keys.
+ */
+static rps_status_t
+upstream_snapshot_ring(struct upstream_snapshot *snap) {
+    struct upstream_ring_node *nodes;
+    char key[UPSTREAM_KEY_MAX_LENGTH + 8];
+    uint32_t i, v, n;
+    int len;
+
+    if (snap->n == 0) {
+        return RPS_OK;
+    }
+
+    n = snap->n * UPSTREAM_HASH_VNODES;
+
+    nodes = rps_alloc(n * sizeof(*nodes));
+    if (nodes == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    snap->schedule = rps_alloc(n * sizeof(uint32_t));
+    snap->ring = rps_alloc(n * sizeof(uint32_t));
+    if (snap->schedule == NULL || snap->ring == NULL) {
+        rps_free(nodes);
+        return RPS_ENOMEM;
+    }
+
+    for (i = 0; i < snap->n; i++) {
+        len = upstream_key(snap->elts[i], key, UPSTREAM_KEY_MAX_LENGTH);
+        len = MIN(len, UPSTREAM_KEY_MAX_LENGTH - 1);
+        for (v = 0; v < UPSTREAM_HASH_VNODES; v++) {
+            nodes[i * UPSTREAM_HASH_VNODES + v].idx = i;
+            MurmurHash3_x86_32(key, len + snprintf(key + len, 8, "#%u", v), 0, 
+                    &nodes[i * UPSTREAM_HASH_VNODES + v].hash);
+        }
+    }
+
+    qsort(nodes, n, sizeof(*nodes), upstream_ring_node_cmp);
+
+    for (i = 0; i < n; i++) {
+        snap->ring[i] = nodes[i].hash;
+        snap->schedule[i] = nodes[i].idx;
+    }
+    snap->nschedule = n;
+
+    rps_free(nodes);
+
+    return RPS_OK;
+}
+
+/*
+ * Enter and leave the read side. Stores and loads here are sequentially 
+ * consistent, so a reader either published its epoch before the writer
+ * scanned the readers, or it's guaranteed to load the new snapshot.
+ */
+static struct upstream_reader *
+upstreams_read_lock(struct upstreams *us) {
+    struct upstream_reader *r;
+
+    r = uv_key_get(&us->reader_key);
+    ASSERT(r != NULL);
+
+    __atomic_store_n(&r->epoch, __atomic_load_n(&us->epoch, __ATOMIC_SEQ_CST), 
+            __ATOMIC_SEQ_CST);
+
+    return r;
+}
+
+/* xorshift64* of the calling server thread, avoid the locked global rand() */
+static uint32_t
+upstreams_random(struct upstream_reader *r, uint32_t max) {
+    uint64_t x;
+
+    ASSERT(max > 0);
+
+    x = r->seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    r->seed = x;
+
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32) % max;
+}
+
+static void
+upstreams_read_unlock(struct upstream_reader *r) {
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Whether all the readers have left the read side entered before epoch */
+static bool
+upstreams_quiescent(struct upstreams *us, uint64_t epoch) {
+    uint32_t i;
+    uint64_t e;
+
+    for (i = 0; i < us->nreaders; i++) {
+        e = __atomic_load_n(&us->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e < epoch) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
-static bool
-upstream_poor_quality(struct upstream *u, float max_fail_rate) {
-    float fail_rate;
+/* Must be called with pool lock held */
+static rps_status_t
+upstream_pool_publish(struct upstreams *us, struct upstream_pool *up) {
+    struct upstream_snapshot *snap, *old;
+    struct upstream *u;
+    uint64_t epoch;
 
-    if (u->failure <= UPSTREAM_MIN_FAILURE) {
-        return false;
-    }
+    /* clear before read the enable flags, a concurrent disable set it again */
+    __atomic_store_n(&up->dirty, 0, __ATOMIC_SEQ_CST);
 
-    if (max_fail_rate == 0.0) {
-        //ignore max_fail_rate if be setted to 0
-        return false;
+    snap = upstream_snapshot_create(&up->pool);
+    if (snap == NULL) {
+        rps_atomic_store(&up->dirty, 1);
+        return RPS_ENOMEM;
     }
 
-    fail_rate = (u->failure/(float)(u->failure + u->success));
+    if ((us->schedule == up_wrr && upstream_snapshot_schedule(snap) != RPS_OK) ||
+            (us->schedule == up_hash && upstream_snapshot_ring(snap) != RPS_OK)) {
+        upstream_snapshot_free(snap);
+        rps_atomic_store(&up->dirty, 1);
+        return RPS_ENOMEM;
+    }
 
-    return fail_rate > max_fail_rate;
-}
+    old = up->snapshot;
+    __atomic_store_n(&up->snapshot, snap, __ATOMIC_SEQ_CST);
 
+    epoch = __atomic_add_fetch(&us->epoch, 1, __ATOMIC_SEQ_CST);
 
-static bool
-upstream_request_too_often(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uint32_t mr1d) {
-    uint32_t m, h, d;   
-    uint32_t i, j, n;
-    rps_ts_t now, m_ago, h_ago, d_ago;
-    rps_ts_t ts;
-    rps_ts_t deadline;
-    rps_queue_t *timewheel;
-
-    m = 0;
-    h = 0;
-    d = 0;
+    if (old != NULL) {
+        old->retire_epoch = epoch;
+        old->retire_next = up->retired_snapshots;
+        up->retired_snapshots = old;
+    }
 
-    now = rps_now();
-    m_ago = now - 60;
-    h_ago = now - 60 * 60;
-    d_ago = now - 60 * 60 * 24;
+    for (u = up->retired; u != NULL; u = u->retire_next) {
+        if (u->retire_epoch == 0) {
+            u->retire_epoch = epoch;
+        }
+    }
 
-    timewheel = &u->timewheel;
+    return RPS_OK;
+}
 
-    i = timewheel->head;
-    n = queue_n(timewheel);
-    
-    if (mr1d > 0) {
-        deadline = d_ago;
-    } else if (mr1h > 0) {
-        deadline = h_ago;
-    } else if (mr1m > 0) {
-        deadline = m_ago;
-    } else {
-        deadline = now;
-    }
-    
-    for (j = 0; j < n; j++) {
-        ts = (rps_ts_t)timewheel->elts[i];
-        i = (i + 1) % timewheel->nelts;
+/* 
+ * An upstream is disabled on the selection path, the selection skip it 
+ * until the snapshot is republished by upstream_pool_compact.
+ */
+static void
+upstream_pool_disable(struct upstream_pool *up, struct upstream *u) {
+    rps_atomic_store(&u->enable, 0);
+    rps_atomic_store(&up->dirty, 1);
+}
 
-        //remove the ts older than deadline.
-        if (ts < deadline) {
-            queue_de(timewheel);
-            continue;   
+/* Free the retired snapshots and upstreams no reader can reach any more */
+static void
+upstream_pool_reclaim(struct upstreams *us, struct upstream_pool *up) {
+    struct upstream_snapshot **psnap, *snap;
+    struct upstream **pu, *u;
+
+    psnap = &up->retired_snapshots;
+    while ((snap = *psnap) != NULL) {
+        if (!upstreams_quiescent(us, snap->retire_epoch)) {
+            psnap = &snap->retire_next;
+            continue;
         }
+        *psnap = snap->retire_next;
+        upstream_snapshot_free(snap);
+    }
 
-        if (ts > m_ago) {
-            m += 1;
-            h += 1;
+    pu = &up->retired;
+    while ((u = *pu) != NULL) {
+        if (u->retire_epoch == 0 || !upstreams_quiescent(us, u->retire_epoch)) {
+            pu = &u->retire_next;
             continue;
         }
 
-        if (ts > h_ago) {
-            h += 1;
+        /* sessions still be using it */
+        upstream_aggregate(u);
+        if (upstream_in_use(u)) {
+            pu = &u->retire_next;
+            continue;
         }
+        *pu = u->retire_next;
+        upstream_deinit(u);
+        rps_free(u);
     }
+}
 
-    d = queue_n(timewheel); 
-
-    //no free timewhell slot means balance exhasuted 
-    if queue_is_full(timewheel) {
-        return true;
+/* 
+ * Republish a dirty pool from a server loop, out of the read side. Only the
+ * schedules picking from the dense array do it inline, an O(n) pointer copy.
+ * Rebuilding wrr schedule or hash ring is too heavy, it's left to the refresh
+ * or stats thread. Never wait for the lock, the next selection retries.
+ */
+static void
+upstream_pool_compact(struct upstreams *us, struct upstream_pool *up) {
+    if (us->schedule == up_wrr || us->schedule == up_hash || 
+            !rps_atomic_load(&up->dirty)) {
+        return;
     }
 
-    return ((mr1m != 0 && m >= mr1m) || 
-            (mr1h != 0 && h >= mr1h) || 
-            (mr1d != 0 && d >= mr1d));
-}
+    if (uv_mutex_trylock(&up->lock) != 0) {
+        return;
+    }
 
-static void
-upstream_timewheel_add(struct upstream *u) {
-    rps_ts_t now;
-    
-    now = rps_now();
+    if (rps_atomic_load(&up->dirty)) {
+        upstream_pool_publish(us, up);
+        upstream_pool_reclaim(us, up);
+    }
 
-    queue_en(&u->timewheel, (void *)now);
+    uv_mutex_unlock(&up->lock);
 }
 
 static rps_status_t
@@ -215,7 +1033,12 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
     char stats_api[MAX_API_LENGTH];
 
     up->timeout = capi->timeout;
-    uv_rwlock_init(&up->rwlock);
+    uv_mutex_init(&up->lock);
+    up->snapshot = NULL;
+    up->retired_snapshots = NULL;
+    up->retired = NULL;
+    up->cursor = 0;
+    up->dirty = 0;
 
     up->proto = rps_proto_int((const char *)cu->proto.data);
     if (up->proto < 0) {
@@ -268,8 +1091,6 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
         return RPS_ERROR;       
     }
 
-    hashmap_iterator_init(&up->iter, &up->pool);
-
     return RPS_OK;
 }
 
@@ -288,13 +1109,29 @@ upstream_pool_deinit_foreach(void *data) {
 
 static void
 upstream_pool_deinit(struct upstream_pool *up) {
+    struct upstream_snapshot *snap;
+    struct upstream *u;
+
+    while ((snap = up->retired_snapshots) != NULL) {
+        up->retired_snapshots = snap->retire_next;
+        upstream_snapshot_free(snap);
+    }
+    if (up->snapshot != NULL) {
+        upstream_snapshot_free(up->snapshot);
+        up->snapshot = NULL;
+    }
+    while ((u = up->retired) != NULL) {
+        up->retired = u->retire_next;
+        upstream_deinit(u);
+        rps_free(u);
+    }
+
     hashmap_foreach2(&up->pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
     hashmap_deinit(&up->pool);
-    hashmap_iterator_deinit(&up->iter);
     string_deinit(&up->api);
     string_deinit(&up->stats_api);
     up->timeout = 0;
-    uv_rwlock_destroy(&up->rwlock);
+    uv_mutex_destroy(&up->lock);
 } 
 
 #ifdef  RPS_MORE_VERBOSE
@@ -307,7 +1144,7 @@ upstream_pool_dump(struct upstream_pool *up) {
 
 rps_status_t 
 upstreams_init(struct upstreams *us, struct config_api *capi, 
-        struct config_upstreams *cus) {
+        struct config_upstreams *cus, uint32_t nreaders) {
 
     rps_status_t status;
     rps_str_t   *schedule;
@@ -322,6 +1159,27 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
     us->mr1h = cus->mr1h;
     us->mr1d = cus->mr1d;
     us->max_fail_rate = cus->max_fail_rate;
+    us->health_halflife = MAX(cus->health_halflife / UPSTREAM_HEALTH_TICK, 1);
+    us->warm = cus->warm;
+    us->warm_idle = cus->warm_idle;
+    us->hedge = cus->hedge;
+    us->hedge_delay = cus->hedge_delay;
+    us->breaker = cus->breaker;
+    us->breaker_backoff = cus->breaker_backoff;
+    us->check_interval = cus->check_interval;
+    us->check_concurrency = cus->check_concurrency;
+    us->nprobers = 0;
+
+    string_init(&us->check_target);
+    if (us->check_interval > 0) {
+        if (string_empty(&cus->check_target)) {
+            log_error("check_target is required by upstream health check");
+            return RPS_ERROR;
+        }
+        if (string_copy(&us->check_target, &cus->check_target) != RPS_OK) {
+            return RPS_ENOMEM;
+        }
+    }
 
     schedule = &cus->schedule;
     if (rps_strcmp(schedule, "rr") == 0) {
@@ -329,12 +1187,26 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
     } else if (rps_strcmp(schedule, "random") == 0) {
         us->schedule = up_random;
     } else if (rps_strcmp(schedule, "wrr") == 0) {
-        log_error("wrr algorithm have not implemented");
-        abort();
+        us->schedule = up_wrr;
+    } else if (rps_strcmp(schedule, "fastest") == 0) {
+        us->schedule = up_fastest;
+    } else if (rps_strcmp(schedule, "p2c") == 0) {
+        us->schedule = up_p2c;
+    } else if (rps_strcmp(schedule, "hash") == 0) {
+        us->schedule = up_hash;
     } else {
         NOT_REACHED();
     }
 
+    if (string_empty(&cus->hash_key) || rps_strcmp(&cus->hash_key, "client") == 0) {
+        us->hash_key = up_hash_client;
+    } else if (rps_strcmp(&cus->hash_key, "target") == 0) {
+        us->hash_key = up_hash_target;
+    } else {
+        log_error("unsupport upstream hash key: %s", cus->hash_key.data);
+        return RPS_ERROR;
+    }
+
     len = array_n(cus->pools);
 
     status = array_init(&us->pools, len, sizeof(struct upstream_pool));
@@ -359,6 +1231,19 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
         goto error;     
     }
 
+    if (uv_key_create(&us->reader_key) < 0) {
+        goto error;
+    }
+
+    us->readers = rps_alloc(MAX(nreaders, 1) * sizeof(struct upstream_reader));
+    if (us->readers == NULL) {
+        goto error;
+    }
+    memset(us->readers, 0, MAX(nreaders, 1) * sizeof(struct upstream_reader));
+    us->nreaders = nreaders;
+    us->nregistered = 0;
+    us->epoch = 1;
+
     curl_global_init(CURL_GLOBAL_ALL);
     
     us->once = 0;
@@ -382,11 +1267,292 @@ upstreams_deinit(struct upstreams *us) {
 
     array_deinit(&us->pools);
 
+    string_deinit(&us->check_target);
+
     uv_mutex_destroy(&us->mutex);
     uv_cond_destroy(&us->ready);
+    uv_key_delete(&us->reader_key);
+    rps_free(us->readers);
     curl_global_cleanup();
 }
 
+/* Called by every server thread before it select upstreams */
+void
+upstreams_register(struct upstreams *us) {
+    uint32_t i;
+
+    i = rps_atomic_fetch_add(&us->nregistered, 1);
+    ASSERT(i < us->nreaders);
+
+    us->readers[i].id = i;
+    us->readers[i].seed = ((uint64_t)rps_now() ^ ((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+    uv_key_set(&us->reader_key, &us->readers[i]);
+}
+
+/* Only the calling thread writes its shard, no atomic RMW needed */
+static struct upstream_shard *
+upstreams_shard(struct upstreams *us, struct upstream *u) {
+    struct upstream_reader *r;
+
+    r = uv_key_get(&us->reader_key);
+    ASSERT(r != NULL);
+
+    return &u->shards[r->id];
+}
+
+void
+upstreams_mark_success(struct upstreams *us, struct upstream *u) {
+    struct upstream_shard *shard;
+
+    shard = upstreams_shard(us, u);
+    upstream_score_add(&shard->score_success, us->health_halflife);
+
+    /* Be the last access, the upstream may be reclaimed once not in use */
+    rps_atomic_store(&shard->success, shard->success + 1);
+}
+
+static bool
+upstreams_latency_aware(struct upstreams *us) {
+    return us->schedule == up_fastest || us->schedule == up_p2c;
+}
+
+/* EWMA of the samples of one thread, only the owner thread writes its shard */
+static void
+upstream_ewma_update(uint32_t *avg, uint32_t sample) {
+    uint32_t old, new;
+
+    sample = MAX(sample, 1);
+    old = *avg;
+
+    if (old == 0) {
+        new = sample;
+    } else {
+        new = old - old / UPSTREAM_EWMA_WEIGHT + sample / UPSTREAM_EWMA_WEIGHT;
+        new = MAX(new, 1);
+    }
+
+    rps_atomic_store(avg, new);
+}
+
+/* Mean of the shards measured, smaller is faster, 0 means unmeasured */
+static uint32_t
+upstream_latency(struct upstream *u) {
+    struct upstream_shard *shard;
+    uint64_t handshake, connect;
+    uint32_t i, nhandshake, nconnect, rtt;
+
+    handshake = 0;
+    connect = 0;
+    nhandshake = 0;
+    nconnect = 0;
+
+    for (i = 0; i < u->nshards; i++) {
+        shard = &u->shards[i];
+        rtt = __atomic_load_n(&shard->rtt_handshake, __ATOMIC_RELAXED);
+        if (rtt != 0) {
+            handshake += rtt;
+            nhandshake++;
+        }
+        rtt = __atomic_load_n(&shard->rtt_connect, __ATOMIC_RELAXED);
+        if (rtt != 0) {
+            connect += rtt;
+            nconnect++;
+        }
+    }
+
+    if (nhandshake > 0) {
+        return (uint32_t)(handshake / nhandshake);
+    }
+
+    return nconnect > 0 ? (uint32_t)(connect / nconnect) : 0;
+}
+
+/* 
+ * Failure count as a slow sample, a fast refused connect should not look good.
+ * Only connect and handshake failures count toward the breaker, an established
+ * session may end badly for reasons of client or remote (reset, idle timeout).
+ */
+void
+upstreams_mark_failure(struct upstreams *us, struct upstream *u, uint32_t elapsed,
+        bool established) {
+    struct upstream_shard *shard;
+
+    shard = upstreams_shard(us, u);
+
+    if (upstreams_latency_aware(us)) {
+        upstream_ewma_update(&shard->rtt_handshake, MAX(elapsed, UPSTREAM_LATENCY_FAIL_PENALTY));
+    }
+
+    upstream_score_add(&shard->score_failure, us->health_halflife);
+
+    if (!established) {
+        upstream_breaker_failure(us, u);
+    }
+
+    /* Be the last access, the upstream may be reclaimed once not in use */
+    rps_atomic_store(&shard->failure, shard->failure + 1);
+}
+
+void
+upstreams_mark_connected(struct upstreams *us, struct upstream *u, uint32_t elapsed) {
+    struct upstream_shard *shard;
+
+    if (upstreams_latency_aware(us)) {
+        shard = upstreams_shard(us, u);
+        upstream_ewma_update(&shard->rtt_connect, elapsed);
+    }
+}
+
+void
+upstreams_mark_established(struct upstreams *us, struct upstream *u, uint32_t elapsed) {
+    struct upstream_shard *shard;
+
+    shard = upstreams_shard(us, u);
+    rps_atomic_store(&shard->established, shard->established + 1);
+    rps_atomic_store(&shard->connect_ms, shard->connect_ms + elapsed);
+
+    if (upstreams_latency_aware(us)) {
+        upstream_ewma_update(&shard->rtt_handshake, elapsed);
+    }
+
+    upstream_breaker_success(us, u);
+}
+
+/* 
+ * Attempt given up before finish (lost hedge race), as if the upstream was
+ * never selected. Elapsed is only a lower bound of its latency.
+ */
+void
+upstreams_mark_cancel(struct upstreams *us, struct upstream *u, uint32_t elapsed) {
+    struct upstream_shard *shard;
+
+    shard = upstreams_shard(us, u);
+
+    if (upstreams_latency_aware(us) && elapsed > shard->rtt_handshake) {
+        upstream_ewma_update(&shard->rtt_handshake, elapsed);
+    }
+
+    /* Be the last access, the upstream may be reclaimed once not in use */
+    rps_atomic_store(&shard->count, shard->count - 1);
+}
+
+/* Bytes relayed by an established session and how long it stayed established */
+void
+upstreams_mark_transfer(struct upstreams *us, struct upstream *u, 
+        uint64_t bytes, uint32_t elapsed) {
+    struct upstream_shard *shard;
+
+    shard = upstreams_shard(us, u);
+    rps_atomic_store(&shard->bytes, shard->bytes + bytes);
+    rps_atomic_store(&shard->transfer_ms, shard->transfer_ms + elapsed);
+}
+
+static void
+upstream_probe_log(struct upstream *u, uint8_t down) {
+    char name[MAX_HOSTNAME_LEN];
+
+    rps_unresolve_addr(&u->server, name);
+    log_debug("upstream %s://%s:%d health check %s", rps_proto_str(u->proto), 
+            name, rps_unresolve_port(&u->server), down ? "down" : "up");
+}
+
+/* Join the health check, return index of the calling thread among probers */
+uint32_t
+upstreams_probe_register(struct upstreams *us) {
+    return rps_atomic_fetch_add(&us->nprobers, 1);
+}
+
+/*
+ * Next upstream to be probed by the prober, the enabled upstreams of all the
+ * pools, down ones included, are split among probers by their position. *cursor keeps the position
+ * across calls, NULL means the round is over. The upstream is taken as a 
+ * selection, it must be marked by upstreams_mark_probe or cancelled.
+ */
+struct upstream *
+upstreams_probe_next(struct upstreams *us, uint32_t prober, uint32_t *cursor) {
+    struct upstream *upstream;
+    struct upstream_pool *up;
+    struct upstream_snapshot *snap;
+    struct upstream_reader *reader;
+    struct upstream_shard *shard;
+    uint32_t i, k, n, nprobers;
+
+    nprobers = MAX(rps_atomic_load(&us->nprobers), 1);
+    upstream = NULL;
+
+    reader = upstreams_read_lock(us);
+
+    for (;;) {
+        k = (*cursor)++ * nprobers + prober;
+
+        for (i = 0; i < array_n(&us->pools); i++) {
+            up = array_get(&us->pools, i);
+            snap = __atomic_load_n(&up->snapshot, __ATOMIC_SEQ_CST);
+            n = snap != NULL ? snap->total : 0;
+            if (k < n) {
+                break;
+            }
+            k -= n;
+        }
+
+        if (i == array_n(&us->pools)) {
+            break;
+        }
+
+        if (rps_atomic_load(&snap->elts[k]->enable)) {
+            upstream = snap->elts[k];
+            break;
+        }
+    }
+
+    if (upstream != NULL) {
+        shard = &upstream->shards[reader->id];
+        rps_atomic_store(&shard->count, shard->count + 1);
+    }
+
+    upstreams_read_unlock(reader);
+    return upstream;
+}
+
+/*
+ * Probe counts as a session. The probe target is known reachable, a single
+ * failure takes the upstream down at once, a success brings it back. Which
+ * pool it belongs to is not tracked, the change is rare, all be republished.
+ */
+void
+upstreams_mark_probe(struct upstreams *us, struct upstream *u, bool ok, uint32_t elapsed) {
+    struct upstream_pool *up;
+    uint8_t down;
+    bool changed;
+    uint32_t i;
+
+    down = ok ? 0 : 1;
+    changed = rps_atomic_load(&u->down) != down;
+
+    if (changed) {
+        rps_atomic_store(&u->down, down);
+        upstream_probe_log(u, down);
+    }
+
+    /* Be the last access, the upstream may be reclaimed once not in use */
+    if (ok) {
+        upstreams_mark_established(us, u, elapsed);
+        upstreams_mark_success(us, u);
+    } else {
+        upstreams_mark_failure(us, u, elapsed, false);
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    for (i = 0; i < array_n(&us->pools); i++) {
+        up = array_get(&us->pools, i);
+        rps_atomic_store(&up->dirty, 1);
+        upstream_pool_compact(us, up);
+    }
+}
+
 static rps_status_t
 upstream_json_parse(struct upstream *u, json_t *element) {
     rps_str_t host;
@@ -570,7 +1736,7 @@ upstream_pool_load(rps_hashmap_t *pool, rps_str_t *api, uint32_t timeout) {
     return status;
 }
 static rps_status_t
-upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
+upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool, uint32_t nshards) {
     struct upstream *u, *nu, *ou;
     char u_key[UPSTREAM_KEY_MAX_LENGTH];
     uint32_t i;
@@ -600,15 +1766,19 @@ upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
                 }   
                 upstream_init(nu);
                 upstream_copy(nu, u);
+                if (upstream_init_shards(nu, nshards) != RPS_OK) {
+                    upstream_deinit(nu);
+                    rps_free(nu);
+                    return RPS_ENOMEM;
+                }
                 hashmap_set(o_pool, u_key, key_size, &nu, sizeof(nu));
             } else {
                 /* update existence proxy */
                 ou = (struct upstream *)*(void **)ov;
-                if (!u->enable && ou->enable) {
-                    ou->enable = 0;
-                } else if (u->enable && !ou->enable) {
-                    ou->enable = 1;
-                    ou->failure /= 2; // shrink the fail rate
+                if (!u->enable && rps_atomic_load(&ou->enable)) {
+                    rps_atomic_store(&ou->enable, 0);
+                } else if (u->enable && !rps_atomic_load(&ou->enable)) {
+                    rps_atomic_store(&ou->enable, 1);
                 }
             }
 
@@ -619,9 +1789,11 @@ upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
     return RPS_OK;
 }
 
-/* cleanup expired upstream proxy, recycle memory resource */
+/* cleanup expired upstream proxy, retire it from the pool, the memory
+ * is recycled once no server thread and session reference it. */
 static rps_status_t
-upstream_pool_cleanup(rps_hashmap_t *pool) {
+upstream_pool_cleanup(struct upstream_pool *up) {
+    rps_hashmap_t *pool = &up->pool;
     uint32_t i;
     rps_ts_t now;
     struct hashmap_entry *e, *n;
@@ -653,7 +1825,7 @@ upstream_pool_cleanup(rps_hashmap_t *pool) {
             }
 #endif
             /* still be using */
-            if ((u->success + u->failure) != u->count) {
+            if (upstream_in_use(u)) {
                 e = e->next;
                 continue;
             }
@@ -662,8 +1834,9 @@ upstream_pool_cleanup(rps_hashmap_t *pool) {
                     name, rps_unresolve_port(&u->server), u->expire_date, now, 
                     u->success, u->failure, u->count);
 
-            upstream_deinit(u);
-            rps_free(u);
+            u->retire_epoch = 0;
+            u->retire_next = up->retired;
+            up->retired = u;
             n = e->next;
             hashmap_remove(pool, e->key, e->key_size);
             e = n;
@@ -679,17 +1852,23 @@ upstream_stats_commit(struct upstream *u, rps_str_t *api, uint32_t timeout) {
     CURLcode res;
     char name[MAX_HOSTNAME_LEN];
     char payload[UPSTREAM_PAYLOAD_MAX_LENGTH];
+    uint64_t connect_ms, speed;
     rps_status_t status;
 
     rps_unresolve_addr(&u->server, name);   
     //avoid flush the output to stdout
     FILE *devnull = fopen("/dev/null", "w+");
 
+    /* Average connect (with handshake) time in ms and transfer speed in bytes/s */
+    connect_ms = u->established > 0 ? u->connect_ms / u->established : 0;
+    speed = u->transfer_ms > 0 ? u->bytes * 1000 / u->transfer_ms : 0;
+
     snprintf(payload, UPSTREAM_PAYLOAD_MAX_LENGTH, 
         "ip=%s&port=%d&uname=%s&passwd=%s&source=%s&success=%d&failure=%d&count=%d&insert_date=%ld \
-        &expire_date=%ld&enable=%d&timewheel=%d",
+        &expire_date=%ld&enable=%d&timewheel=%d&bytes=%llu&connect_ms=%llu&speed=%llu",
         name, rps_unresolve_port(&u->server), u->uname.data, u->passwd.data, u->source.data, u->success,
-        u->failure, u->count,(long int)u->insert_date, (long int)u->expire_date, u->enable, queue_n(&u->timewheel));
+        u->failure, u->count,(long int)u->insert_date, (long int)u->expire_date, u->enable, upstream_limiter_day(u),
+        (unsigned long long)u->bytes, (unsigned long long)connect_ms, (unsigned long long)speed);
 
     curl_handle = curl_easy_init();
     curl_easy_setopt(curl_handle, CURLOPT_URL, api->data);
@@ -716,8 +1895,21 @@ upstream_stats_commit(struct upstream *u, rps_str_t *api, uint32_t timeout) {
     return status;
 }
 
+/* Must be called with pool lock held */
+static void
+upstream_pool_aggregate(struct upstream_pool *up) {
+    struct hashmap_entry *e;
+    uint32_t i;
+
+    for (i = 0; i < up->pool.size; i++) {
+        for (e = up->pool.buckets[i]; e != NULL; e = e->next) {
+            upstream_aggregate((struct upstream *)*(void **)e->value);
+        }
+    }
+}
+
 static void
-upstream_pool_stats(struct upstream_pool *up) {
+upstream_pool_stats(struct upstreams *us, struct upstream_pool *up) {
     struct hashmap_entry *entry;
     struct upstream *upstream;
     struct upstream *t_upstream;
@@ -731,7 +1923,11 @@ upstream_pool_stats(struct upstream_pool *up) {
     /* hashmap is non thread safe
      * copy the upstream pool in temporary array, avoid memory race condition 
      */
-    uv_rwlock_rdlock(&up->rwlock);
+    uv_mutex_lock(&up->lock);
+    upstream_pool_aggregate(up);
+    if (rps_atomic_load(&up->dirty)) {
+        upstream_pool_publish(us, up);
+    }
     array_init(&t_pool, hashmap_n(&up->pool), sizeof(struct upstream));
     for (i = 0; i < up->pool.size; i++) {
         entry = up->pool.buckets[i];
@@ -743,7 +1939,7 @@ upstream_pool_stats(struct upstream_pool *up) {
             entry = entry->next;
         }
     }
-    uv_rwlock_rdunlock(&up->rwlock);
+    uv_mutex_unlock(&up->lock);
 
     while (array_n(&t_pool)) {
         t_upstream = (struct upstream *)array_pop(&t_pool);
@@ -755,7 +1951,7 @@ upstream_pool_stats(struct upstream_pool *up) {
 }
 
 static rps_status_t
-upstream_pool_refresh(struct upstream_pool *up) {
+upstream_pool_refresh(struct upstreams *us, struct upstream_pool *up) {
     rps_hashmap_t new_pool;
 
     /* Free current upstream pool only when new pool load successful */
@@ -771,10 +1967,15 @@ upstream_pool_refresh(struct upstream_pool *up) {
         return RPS_ERROR;
     }
 
-    uv_rwlock_wrlock(&up->rwlock);
-    upstream_pool_merge(&up->pool, &new_pool);
-    upstream_pool_cleanup(&up->pool);
-    uv_rwlock_wrunlock(&up->rwlock);
+    uv_mutex_lock(&up->lock);
+    upstream_pool_aggregate(up);
+    upstream_pool_merge(&up->pool, &new_pool, us->nreaders);
+    upstream_pool_cleanup(up);
+    if (upstream_pool_publish(us, up) != RPS_OK) {
+        log_error("publish %s upstream pool failed", rps_proto_str(up->proto));
+    }
+    upstream_pool_reclaim(us, up);
+    uv_mutex_unlock(&up->lock);
     
     hashmap_foreach2(&new_pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
     hashmap_deinit(&new_pool);
@@ -803,7 +2004,7 @@ upstreams_refresh(uv_timer_t *handle) {
 
         proto = rps_proto_str(up->proto);
 
-        if (upstream_pool_refresh(up) != RPS_OK) { 
+        if (upstream_pool_refresh(us, up) != RPS_OK) { 
             log_error("update %s upstream proxy pool failed", proto) ;
             return;
         } else {
@@ -814,10 +2015,10 @@ upstreams_refresh(uv_timer_t *handle) {
     //run only once
     if (us->once == 0) {
         uv_mutex_lock(&us->mutex);
+        us->once = 1;
         uv_cond_broadcast(&us->ready);
         uv_mutex_unlock(&us->mutex);
     }
-    us->once = 1;
 }
 
 void
@@ -834,63 +2035,171 @@ upstreams_stats(uv_timer_t *handle) {
     for (i=0; i< len; i++) {
         up = (struct upstream_pool *)array_get(&us->pools, i);
         proto = rps_proto_str(up->proto);
-        upstream_pool_stats(up);
+        upstream_pool_stats(us, up);
         log_info("commit %s upstream pool, count <%d> proxys", proto, hashmap_n(&up->pool));
     }
 }
 
-static struct upstream *
-upstream_pool_get_rr(struct upstream_pool *up) {
-    struct hashmap_entry *entry;
-    struct upstream *upstream;
+static uint32_t
+upstream_pool_get_rr(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream_snapshot *snap, struct upstream_reader *r, uint32_t hash) {
+    UNUSED(us);
+    UNUSED(r);
+    UNUSED(hash);
 
-    entry = hashmap_next(&up->iter);
-    if (entry == NULL) {
-        return NULL;
+    return rps_atomic_fetch_add(&up->cursor, 1) % snap->n;
+}
+
+static uint32_t
+upstream_pool_get_wrr(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream_snapshot *snap, struct upstream_reader *r, uint32_t hash) {
+    UNUSED(us);
+    UNUSED(r);
+    UNUSED(hash);
+
+    return rps_atomic_fetch_add(&up->cursor, 1) % snap->nschedule;
+}
+
+/* Latency weighed by recent health, a fast but failing upstream looks slow */
+static uint64_t
+upstream_cost(struct upstreams *us, struct upstream *u, uint64_t load) {
+    return load * UPSTREAM_HEALTH_ONE / MAX(upstream_health(us, u), 1);
+}
+
+/*
+ * Pick the lowest latency weighed by health among a few random samples, 
+ * unmeasured one first. A small share of picks go random to keep measuring
+ * the others.
+ */
+static uint32_t
+upstream_pool_get_fastest(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream_snapshot *snap, struct upstream_reader *r, uint32_t hash) {
+    uint32_t i, idx, best, n, rtt;
+    uint64_t cost, min;
+
+    UNUSED(up);
+    UNUSED(hash);
+
+    if (upstreams_random(r, UPSTREAM_FASTEST_EXPLORE) == 0) {
+        return upstreams_random(r, snap->n);
     }
-    upstream = (struct upstream *)*(void **)entry->value;
 
-    return upstream;
+    n = MIN(snap->n, UPSTREAM_FASTEST_SAMPLES);
+    best = 0;
+    min = UINT64_MAX;
+
+    for (i = 0; i < n; i++) {
+        idx = snap->n <= UPSTREAM_FASTEST_SAMPLES ? i : upstreams_random(r, snap->n);
+        rtt = upstream_latency(snap->elts[idx]);
+        if (rtt == 0) {
+            return idx;
+        }
+        cost = upstream_cost(us, snap->elts[idx], rtt);
+        if (cost < min) {
+            min = cost;
+            best = idx;
+        }
+    }
+
+    return best;
 }
 
-static struct upstream *
-upstream_pool_get_random(struct upstream_pool *up) {
-    struct hashmap_entry *entry;
-    struct upstream *upstream;
+/* Power of two choices, the one with fewer sessions in flight weighed by 
+ * health, lower latency wins the tie. */
+static uint32_t
+upstream_pool_get_p2c(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream_snapshot *snap, struct upstream_reader *r, uint32_t hash) {
+    uint32_t a, b;
+    uint64_t fa, fb;
 
-    entry = hashmap_get_random_entry(&up->pool);
-    if (entry == NULL) {
-        return NULL;
+    UNUSED(up);
+    UNUSED(hash);
+
+    if (snap->n == 1) {
+        return 0;
     }
-    upstream = (struct upstream *)*(void **)entry->value;
 
-    return upstream;
+    a = upstreams_random(r, snap->n);
+    b = upstreams_random(r, snap->n - 1);
+    if (b >= a) {
+        b += 1;
+    }
+
+    fa = upstream_cost(us, snap->elts[a], (uint64_t)upstream_inflight(snap->elts[a]) + 1);
+    fb = upstream_cost(us, snap->elts[b], (uint64_t)upstream_inflight(snap->elts[b]) + 1);
+
+    if (fa != fb) {
+        return fa < fb ? a : b;
+    }
+
+    return upstream_latency(snap->elts[b]) < upstream_latency(snap->elts[a]) ? b : a;
+}
+
+static uint32_t
+upstream_pool_get_random(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream_snapshot *snap, struct upstream_reader *r, uint32_t hash) {
+    UNUSED(us);
+    UNUSED(up);
+    UNUSED(hash);
+
+    return upstreams_random(r, snap->n);
+}
+
+/* The first ring point clockwise from the key hash */
+static uint32_t
+upstream_pool_get_hash(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream_snapshot *snap, struct upstream_reader *r, uint32_t hash) {
+    uint32_t lo, hi, mid;
+
+    UNUSED(us);
+    UNUSED(up);
+    UNUSED(r);
+
+    lo = 0;
+    hi = snap->nschedule;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (snap->ring[mid] < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo == snap->nschedule ? 0 : lo;
 }
 
 struct upstream *
-upstreams_get(struct upstreams *us, rps_proto_t proto) {
+upstreams_get(struct upstreams *us, rps_proto_t proto, const char *key, size_t klen) {
     struct upstream *upstream;
     struct upstream_pool *up;
+    struct upstream_snapshot *snap;
+    struct upstream_reader *reader;
+    struct upstream_shard *shard;
     int i, len;
-    int count;
+    uint32_t start, j, k, n;
+    uint32_t hash;
     upstream_pool_get_algorithm get_func;
 
     upstream = NULL;
     up = NULL;
     get_func = NULL;
-    count = 0;
+
+    reader = upstreams_read_lock(us);
 
     if (us->hybrid) {
+        len = array_n(&us->pools);
         if (proto == HTTP_TUNNEL || proto == SOCKS5) {
             // http_tunnel, socks5 can only forward via http_tunnel or socks5   
             for (; ;) {
-                up = array_random(&us->pools);
+                up = array_get(&us->pools, upstreams_random(reader, len));
                 if (up->proto == HTTP_TUNNEL || up->proto == SOCKS5) {
                     break;
                 }
             }
         } else {
-            up = array_random(&us->pools);
+            up = array_get(&us->pools, upstreams_random(reader, len));
         }
     } else {
         len = array_n(&us->pools);
@@ -910,61 +2219,86 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
             get_func = upstream_pool_get_random;
             break;
         case up_wrr:
+            get_func = upstream_pool_get_wrr;
+            break;
+        case up_fastest:
+            get_func = upstream_pool_get_fastest;
+            break;
+        case up_p2c:
+            get_func = upstream_pool_get_p2c;
+            break;
+        case up_hash:
+            get_func = upstream_pool_get_hash;
+            break;
         default:
             NOT_REACHED();
     }   
 
-    uv_rwlock_wrlock(&up->rwlock);
+    snap = __atomic_load_n(&up->snapshot, __ATOMIC_SEQ_CST);
+    if (snap == NULL || snap->n == 0) {
+        upstreams_read_unlock(reader);
+        upstream_pool_compact(us, up);
+        return NULL;
+    }
 
-    for ( ; ; ) {
-        if (count >= UPSTREAM_MAX_LOOP) {
-            upstream = NULL;
-            break;
-        }
+    /* Probe from the scheduled one, the snapshot may still hold 
+     * the upstreams disabled after it be published. */
+    n = snap->schedule != NULL ? snap->nschedule : snap->n;
+    hash = 0;
+    if (key != NULL && klen > 0) {
+        MurmurHash3_x86_32(key, (int)klen, 0, &hash);
+    }
 
-        upstream = get_func(up);
+    start = get_func(us, up, snap, reader, hash);
 
-        count += 1;
+    for (j = 0; j < n; j++) {
+        k = (start + j) % n;
+        upstream = snap->elts[snap->schedule != NULL ? snap->schedule[k] : k];
 
-        if (upstream == NULL) {
-            break;
+        if (!rps_atomic_load(&upstream->enable) || rps_atomic_load(&upstream->down)) {
+            continue;
         }
 
-        if (!upstream->enable) {
+        if (upstream_poor_quality(us, upstream)) {
+            upstream_pool_disable(up, upstream);
             continue;
         }
 
-        if (upstream_poor_quality(upstream, us->max_fail_rate)) {
-            upstream->enable = 0;
+        if (upstream_breaker_blocked(upstream)) {
             continue;
         }
 
-        if (upstream_freshly(upstream)) {
-            upstream_init_timewheel(upstream, us->mr1m, us->mr1h, us->mr1d);
-            break;
+        if (upstream_rate_limited(upstream, us)) {
+            continue;
         }
 
-        if (upstream_request_too_often(upstream, us->mr1m, us->mr1h, us->mr1d)) {
-            upstream = NULL;
+        /* Last check, a half open trial slot is only taken by a real pick */
+        if (!upstream_breaker_allow(us, upstream)) {
             continue;
         }
 
         break;
     }
 
+    if (j == n) {
+        upstream = NULL;
+    }
+
 #if RPS_DEBUG_OPEN
     if (upstream != NULL) {
         upstream_str(upstream);
     } 
 #endif
     
+    /* the count must be taken before leave read side, 
+     * it keep the upstream alive after be retired. */
     if (upstream != NULL) {
-        upstream->count += 1;    
-        if (us->mr1m > 0 || us->mr1h > 0 || us->mr1d >0) {
-            upstream_timewheel_add(upstream);
-        }
+        shard = &upstream->shards[reader->id];
+        rps_atomic_store(&shard->count, shard->count + 1);
     }
     
-    uv_rwlock_wrunlock(&up->rwlock);
+    upstreams_read_unlock(reader);
+    upstream_pool_compact(us, up);
+
     return upstream;
 }
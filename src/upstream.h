@@ -13,11 +13,30 @@
 
 #define UPSTREAM_DEFAULT_WEIGHT 10
 #define UPSTREAM_DEFAULT_POOL_LENGTH 10000
-#define UPSTREAM_DEFAULT_TIME_WHEEL_LENGTH 1000
+#define UPSTREAM_LIMITER_SECS   60
+#define UPSTREAM_LIMITER_MINS   60
+#define UPSTREAM_LIMITER_HOURS  24
 #define UPSTREAM_DEFAULT_SCHEDULE up_rr
 
 #define UPSTREAM_MIN_FAILURE   10
-#define UPSTREAM_MAX_LOOP      200
+
+#define UPSTREAM_HEALTH_UNIT    256     /* fixed point of one outcome in scores */
+#define UPSTREAM_HEALTH_TICK    100     /* ms, time resolution of score decay */
+#define UPSTREAM_HEALTH_ONE     1024    /* health of an upstream never failed */
+
+#define UPSTREAM_EWMA_WEIGHT            8       /* alpha = 1/8 */
+#define UPSTREAM_FASTEST_SAMPLES        8
+#define UPSTREAM_FASTEST_EXPLORE        16      /* explore randomly 1/16 picks */
+#define UPSTREAM_LATENCY_FAIL_PENALTY   3000    /* ms */
+
+#define UPSTREAM_BREAKER_WINDOW     10000   /* ms, failure window of breaker */
+#define UPSTREAM_BREAKER_TRIALS     3       /* sessions let through while half open */
+#define UPSTREAM_BREAKER_MAX_SHIFT  4       /* backoff grows up to 16 times */
+
+#define UPSTREAM_HASH_VNODES        160     /* virtual nodes per upstream */
+
+#define UPSTREAM_WRR_MAX_SCHEDULE   65536
+#define UPSTREAM_WRR_STRIDE         (1 << 30)
 
 #define UPSTREAM_KEY_MAX_LENGTH 128
 #define UPSTREAM_PAYLOAD_MAX_LENGTH 512
@@ -26,11 +45,72 @@ enum upstream_schedule {
     up_rr,         /* round-robin */
     up_wrr,        /* weighted round-robin*/
     up_random,     /* raondom schedule */
+    up_fastest,    /* least response time */
+    up_p2c,        /* power of two choices by in-flight sessions */
+    up_hash,       /* consistent hash by hash_key */
+};
+
+enum upstream_breaker_state {
+    up_breaker_closed,      /* sessions pass */
+    up_breaker_open,        /* rejected until backoff passed */
+    up_breaker_half_open,   /* a few trial sessions pass */
+};
+
+enum upstream_hash_key {
+    up_hash_client,     /* client ip */
+    up_hash_target,     /* remote host */
 };
 
 /*
  * upstreams.pools -> {2-3}upstream_pool.pool -> {n}upstream
+ *
+ * The hashmap pool is only touched by refresh and stats threads under
+ * upstream_pool.lock. Server threads select upstream from the immutable 
+ * snapshot which is rebuilt and published after every refresh. 
+ * The replaced snapshots and removed upstreams are retired, and be freed 
+ * once all the server threads have left the read side since then (epoch based).
+ */
+
+/* 
+ * Counters and health of one server thread, aligned to avoid false sharing.
+ * Selection reads the scores and EWMAs of all the shards.
+ */
+struct upstream_shard {
+    uint64_t    bytes;          /* relayed both directions */
+    uint64_t    connect_ms;     /* connect and handshake time of established sessions */
+    uint64_t    transfer_ms;    /* time sessions stay established */
+
+    /* 
+     * Exponentially decayed outcome scores, half of them is forgotten every
+     * health_halflife. High 32 bits the tick last decayed, low 32 bits the 
+     * score in 1/UPSTREAM_HEALTH_UNIT.
+     */
+    uint64_t    score_success;
+    uint64_t    score_failure;
+
+    uint32_t    success;
+    uint32_t    failure;
+    uint32_t    count;
+    uint32_t    established;
+
+    /* EWMA of connect and handshake latency in ms, 0 means unmeasured */
+    uint32_t    rtt_connect;
+    uint32_t    rtt_handshake;
+} __attribute__((aligned(RPS_CACHELINE_SIZE)));
+
+/* 
+ * Bucketed request counter, the requests of last minute, hour and day 
+ * are the sum of 1 second, 1 minute and 1 hour buckets respectively.
  */
+struct upstream_limiter {
+    rps_ts_t    last;   /* time the buckets have been advanced to */
+    uint32_t    sec[UPSTREAM_LIMITER_SECS];
+    uint32_t    min[UPSTREAM_LIMITER_MINS];
+    uint32_t    hour[UPSTREAM_LIMITER_HOURS];
+    uint32_t    m;      /* running totals */
+    uint32_t    h;
+    uint32_t    d;
+};
 
 struct upstream  {
     rps_addr_t  server;
@@ -40,34 +120,94 @@ struct upstream  {
     rps_str_t   source;
 
     uint16_t    weight;
+
+    /* Aggregated view of the shards, only be updated under pool lock */
     uint32_t    success;
     uint32_t    failure;
     uint32_t    count;
 
+    struct upstream_shard *shards;  /* one per server thread */
+    uint32_t    nshards;
+    uint32_t    agg_success;    /* shards sum at last aggregation */
+    uint32_t    agg_failure;
+    uint32_t    agg_count;
+
+    /* Transfer accounting view, aggregated the same way */
+    uint64_t    bytes;
+    uint64_t    connect_ms;
+    uint64_t    transfer_ms;
+    uint32_t    established;
+    uint64_t    agg_bytes;
+    uint64_t    agg_connect_ms;
+    uint64_t    agg_transfer_ms;
+    uint32_t    agg_established;
+
     rps_ts_t    insert_date;
     rps_ts_t    expire_date;
 
-    /* The time wheel which be used to control the QPS
-     * The element storaged in queue are long int expressed timestamp, 
-     * 4 bytes in 32bit platform, 8 bytes in 64 bits which exactly the pointer length on various platform.
+    /* Sliding window request counter to control the QPS, 
+     * allocated at the first request when mr1m/mr1h/mr1d be setted.
      */
-    rps_queue_t timewheel;
+    struct upstream_limiter *limiter;
+    uv_mutex_t  lock;   /* protect limiter */
     
-    uint8_t     enable:1;
+    uint8_t     enable;
+    uint8_t     down;   /* failed last health check, only toggled by probes */
+
+    /* 
+     * Circuit breaker, updated by server threads lock free. Independent of
+     * enable, which is only toggled by refresh and poor quality.
+     */
+    uint8_t     breaker;        /* upstream_breaker_state */
+    uint8_t     breaker_opens;  /* opened in a row without success, backoff exponent */
+    uint32_t    breaker_fails;  /* consecutive failures */
+    uint32_t    breaker_trials; /* sessions let through since half open */
+    uint32_t    win_success;    /* outcomes of current failure window */
+    uint32_t    win_failure;
+    uint64_t    win_start;      /* ms */
+    uint64_t    breaker_until;  /* ms, end of open backoff or half open trials */
+
+    struct upstream *retire_next;
+    uint64_t    retire_epoch;
+};
+
+struct upstream_snapshot {
+    uint32_t                    n;          /* selectable ones, elts[0, n) */
+    uint32_t                    total;      /* and the down ones after, only probed */
+    uint32_t                    *schedule;  /* wrr sequence or hash ring of elts index */
+    uint32_t                    *ring;      /* hash ring points, ascending */
+    uint32_t                    nschedule;
+    uint64_t                    retire_epoch;
+    struct upstream_snapshot    *retire_next;
+    struct upstream             *elts[];
 };
 
 struct upstream_pool {
     rps_hashmap_t           pool;
-    rps_hashmap_iterator_t  iter;
     rps_proto_t             proto;
     rps_str_t               api;
     rps_str_t               stats_api;
     uint32_t                timeout; //api request max timeout
-    uv_rwlock_t             rwlock;
+    uv_mutex_t              lock; /* serialize refresh and stats */
+
+    struct upstream_snapshot *snapshot;  /* current published, enabled only */
+    struct upstream_snapshot *retired_snapshots;
+    struct upstream         *retired;
+    uint32_t                cursor;      /* round-robin position */
+    uint8_t                 dirty;       /* snapshot need to be republished */
+};
+
+/* Read side state of one server thread, padded to avoid false sharing */
+struct upstream_reader {
+    uint64_t    epoch;  /* epoch entered read side, 0 means quiescent */
+    uint64_t    seed;   /* per-thread PRNG state */
+    uint32_t    id;     /* index of upstream shards */
+    uint8_t     pad[RPS_CACHELINE_SIZE - 2 * sizeof(uint64_t) - sizeof(uint32_t)];
 };
 
 struct upstreams {
     uint8_t                 schedule;
+    uint8_t                 hash_key;
     bool                    hybrid;
     uint16_t                maxreconn;
     uint16_t                maxretry;
@@ -75,7 +215,23 @@ struct upstreams {
     uint32_t                mr1h;
     uint32_t                mr1d;
     float                   max_fail_rate;
+    uint32_t                health_halflife;    /* ticks */
+    uint16_t                warm;       /* warm connections per upstream per server loop */
+    uint32_t                warm_idle;  /* ms */
+    bool                    hedge;
+    uint32_t                hedge_delay;    /* ms */
+    uint32_t                breaker;    /* consecutive failures to open, 0 means disable */
+    uint32_t                breaker_backoff;    /* ms */
+    uint32_t                check_interval;     /* ms, 0 means no health check */
+    uint32_t                check_concurrency;  /* probes in flight per server loop */
+    rps_str_t               check_target;
+    uint32_t                nprobers;   /* server loops sharing the health check */
     rps_array_t             pools;
+    uint64_t                epoch;
+    struct upstream_reader  *readers;
+    uint32_t                nreaders;
+    uint32_t                nregistered;
+    uv_key_t                reader_key;
     uv_cond_t               ready;
     uv_mutex_t              mutex;
     uint8_t                 once:1;
@@ -85,8 +241,21 @@ void upstream_init(struct upstream *u);
 void upstream_deinit(struct upstream *u);
 
 rps_status_t upstreams_init(struct upstreams *us, 
-        struct config_api *api, struct config_upstreams *cu);
-struct upstream  *upstreams_get(struct upstreams *us, rps_proto_t proto);
+        struct config_api *api, struct config_upstreams *cu, uint32_t nreaders);
+void upstreams_register(struct upstreams *us);
+struct upstream  *upstreams_get(struct upstreams *us, rps_proto_t proto, 
+        const char *key, size_t klen);
+void upstreams_mark_success(struct upstreams *us, struct upstream *u);
+void upstreams_mark_failure(struct upstreams *us, struct upstream *u, uint32_t elapsed,
+        bool established);
+void upstreams_mark_connected(struct upstreams *us, struct upstream *u, uint32_t elapsed);
+void upstreams_mark_established(struct upstreams *us, struct upstream *u, uint32_t elapsed);
+void upstreams_mark_cancel(struct upstreams *us, struct upstream *u, uint32_t elapsed);
+void upstreams_mark_transfer(struct upstreams *us, struct upstream *u, 
+        uint64_t bytes, uint32_t elapsed);
+uint32_t upstreams_probe_register(struct upstreams *us);
+struct upstream *upstreams_probe_next(struct upstreams *us, uint32_t prober, uint32_t *cursor);
+void upstreams_mark_probe(struct upstreams *us, struct upstream *u, bool ok, uint32_t elapsed);
 void upstreams_deinit(struct upstreams *us);
 void upstreams_refresh(uv_timer_t *handle);
 void upstreams_stats(uv_timer_t *handler);
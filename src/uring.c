@@ -0,0 +1,192 @@
+#include "core.h"
+#include "uring.h"
+#include "util.h"
+
+#ifdef RPS_HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Return 0 on success, otherwise negative errno */
+int
+uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    unsigned i;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = uring_setup(entries, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+
+    if (!(p.features & IORING_FEAT_FAST_POLL)) {
+        close(r->fd);
+        return -ENOTSUP;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Both rings live in one mapping since 5.4 */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_ring_size = MAX(r->sq_ring_size, r->cq_ring_size);
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        goto error;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto error;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto error;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->sq_mask = *(unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+    /* sqes are always filled in ring order, index array never changes */
+    for (i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+
+    return 0;
+
+error:
+    err = -errno;
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+    }
+    uring_deinit(r);
+    return err;
+}
+
+void
+uring_deinit(struct uring *r) {
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+
+    if (r->sq_ring != NULL) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+
+    r->sqes = NULL;
+    r->sq_ring = NULL;
+    r->cq_ring = NULL;
+    r->fd = -1;
+}
+
+/* Return a zeroed sqe, NULL while submission queue is full */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+
+    if (uring_sq_pending(r) >= r->sq_entries) {
+        return NULL;
+    }
+
+    sqe = &r->sqes[r->sq_local & r->sq_mask];
+    r->sq_local++;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+/* Publish the filled sqes and submit them, return sqes submitted or negative errno */
+int
+uring_submit(struct uring *r) {
+    unsigned n;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+
+    n = uring_sq_pending(r);
+    if (n == 0) {
+        return 0;
+    }
+
+    do {
+        ret = uring_enter(r->fd, n, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return -errno;
+    }
+
+    r->nsubmit++;
+    r->nsqe += ret;
+
+    return ret;
+}
+
+/* Return the oldest unseen cqe, NULL while completion queue is empty */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r) {
+    unsigned head;
+
+    head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &r->cqes[head & r->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+    r->ncqe++;
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Minimal io_uring binding on top of the raw syscalls, liburing isn't
+ * required. Only the submission and completion queue plumbing needed by
+ * the relay engine of server loop. Not thread safe, every server loop
+ * owns its ring.
+ */
+
+#ifndef _RPS_URING_H
+#define _RPS_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* 
+ * Layout doesn't depend on RPS_HAVE_IO_URING, objects built without the
+ * flag (proto) must agree on the size of struct server.
+ */
+struct uring {
+    int                 fd;
+
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_array;
+    unsigned            sq_mask;
+    unsigned            sq_entries;
+    unsigned            sq_local;   /* tail of the filled sqes, published on submit */
+    struct io_uring_sqe *sqes;
+
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void                *sq_ring;
+    size_t              sq_ring_size;
+    void                *cq_ring;
+    size_t              cq_ring_size;
+    size_t              sqes_size;
+
+    uint64_t            nsubmit;    /* io_uring_enter calls */
+    uint64_t            nsqe;       /* sqes submitted */
+    uint64_t            ncqe;       /* cqes reaped */
+};
+
+#ifdef RPS_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_deinit(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+/* sqes filled but not submitted yet */
+static inline unsigned
+uring_sq_pending(struct uring *r) {
+    return r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+#endif
+
+#endif
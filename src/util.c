@@ -68,6 +68,24 @@ _rps_realloc(void *ptr, size_t size, const char *name, int line) {
 }
 
 
+void *
+_rps_memalign(size_t alignment, size_t size, const char *name, int line) {
+    void *p;
+    
+    ASSERT(size != 0);
+
+    if (posix_memalign(&p, alignment, size) != 0) {
+        log_error("memalign(%zu, %zu) failed @ %s:%d", alignment, size, name, line);
+        return NULL;
+    }
+
+#ifdef  RPS_MORE_VERBOSE
+    log_verb("memalign(%zu, %zu) at %p @ %s:%d", alignment, size, p, name, line);
+#endif
+
+    return p;
+}
+
 void 
 #ifdef RPS_MORE_VERBOSE
 _rps_free(void *ptr, const char *name, int line) {
@@ -46,6 +46,9 @@
 #define rps_realloc(_p, _s)                                         \
     _rps_realloc(_p, (size_t)(_s), __FILE__, __LINE__)              \
 
+#define rps_memalign(_a, _s)                                        \
+    _rps_memalign((size_t)(_a), (size_t)(_s), __FILE__, __LINE__)   \
+
 #ifdef RPS_MORE_VERBOSE
 #define rps_free(_p)                                                \
     _rps_free(_p, __FILE__, __LINE__)                               \
@@ -65,6 +68,7 @@ void  *_rps_alloc(size_t size, const char *name, int line);
 void * _rps_zalloc(size_t size, const char *name, int line);
 void *_rps_calloc(size_t nmemb, size_t size, const char *name, int line);
 void *_rps_realloc(void *ptr, size_t size, const char *name, int line);
+void *_rps_memalign(size_t alignment, size_t size, const char *name, int line);
 
 typedef enum { false, true } bool;
 
@@ -84,6 +88,16 @@ void _rps_assert(const char *cond, const char *file, int line);
 
 #define rps_now()   time(NULL)
 
+/* Only be used for the fields written by one thread and read by others */
+#define rps_atomic_load(_p)         __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define rps_atomic_store(_p, _v)    __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+
+/* Counters updated by several threads */
+#define rps_atomic_add(_p, _v)      __atomic_add_fetch((_p), (_v), __ATOMIC_RELAXED)
+#define rps_atomic_fetch_add(_p, _v) __atomic_fetch_add((_p), (_v), __ATOMIC_RELAXED)
+
+#define RPS_CACHELINE_SIZE  64
+
 #define MAX_HOSTNAME_LEN 255
 #define MAX_INET_ADDRSTRLEN MAX_HOSTNAME_LEN
 #define AF_DOMAIN 60 /* AF_INET is 2, AF_INET6 is 30, so we get 60 */